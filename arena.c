@@ -0,0 +1,188 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "backend.h"
+#include "util.h"
+
+struct ArenaEntry
+{
+  uint32_t hash;
+  int forgotten;
+  size_t key_offset;
+  size_t value_offset;
+  size_t len;
+};
+
+struct Arena
+{
+  char* data;
+  size_t size;
+  size_t alloc;
+  struct ArenaEntry* entries;
+  uint32_t n_entries;
+  uint32_t n_alloc;
+  uint32_t* buckets;
+  uint32_t n_buckets;
+  int n_borrowed;
+  /* freed once the last value is released */
+  int retired;
+};
+
+static struct Arena* arena = NULL;
+
+static int
+_arena_collect (const char* key, const char* value, size_t len, void* data)
+{
+  /* only list files are worth it */
+  if (*key != '/')
+    return 0;
+
+  size_t key_len = strlen (key);
+  if (arena->size + key_len+1 + len > arena->alloc)
+    {
+      while (arena->size + key_len+1 + len > arena->alloc)
+        arena->alloc = arena->alloc ? arena->alloc*2 : 1024*1024;
+      arena->data = realloc (arena->data, arena->alloc);
+    }
+  if (arena->n_entries == arena->n_alloc)
+    {
+      arena->n_alloc = arena->n_alloc ? arena->n_alloc*2 : 1024;
+      arena->entries = realloc (arena->entries, arena->n_alloc * sizeof (struct ArenaEntry));
+    }
+
+  struct ArenaEntry* entry = &arena->entries[arena->n_entries++];
+  entry->hash = tdpkg_hash (key, key_len);
+  entry->forgotten = 0;
+  entry->key_offset = arena->size;
+  entry->value_offset = arena->size + key_len+1;
+  entry->len = len;
+  memcpy (arena->data + entry->key_offset, key, key_len+1);
+  memcpy (arena->data + entry->value_offset, value, len);
+  arena->size += key_len+1 + len;
+  return 0;
+}
+
+static struct ArenaEntry*
+_arena_lookup (const char* key)
+{
+  uint32_t hash = tdpkg_hash (key, strlen (key));
+  uint32_t mask = arena->n_buckets-1;
+  uint32_t b;
+  for (b = hash & mask; arena->buckets[b] != UINT32_MAX; b = (b+1) & mask)
+    {
+      struct ArenaEntry* entry = &arena->entries[arena->buckets[b]];
+      if (entry->hash == hash && !strcmp (arena->data + entry->key_offset, key))
+        return entry;
+    }
+  return NULL;
+}
+
+int
+tdpkg_arena_load (void)
+{
+  if (arena)
+    return 0;
+
+  arena = calloc (1, sizeof (struct Arena));
+  if (tdpkg_backend_foreach (0, _arena_collect, NULL))
+    {
+      tdpkg_arena_free ();
+      return -1;
+    }
+
+  arena->n_buckets = 16;
+  while (arena->n_buckets < arena->n_entries*2)
+    arena->n_buckets <<= 1;
+  arena->buckets = malloc (arena->n_buckets * sizeof (uint32_t));
+  memset (arena->buckets, 0xff, arena->n_buckets * sizeof (uint32_t));
+
+  uint32_t mask = arena->n_buckets-1;
+  uint32_t i;
+  for (i=0; i < arena->n_entries; i++)
+    {
+      uint32_t b = arena->entries[i].hash & mask;
+      while (arena->buckets[b] != UINT32_MAX)
+        b = (b+1) & mask;
+      arena->buckets[b] = i;
+    }
+  return 0;
+}
+
+const char*
+tdpkg_arena_get (const char* key, size_t* len)
+{
+  if (!arena || arena->retired)
+    return NULL;
+
+  struct ArenaEntry* entry = _arena_lookup (key);
+  if (!entry || entry->forgotten)
+    return NULL;
+
+  arena->n_borrowed++;
+  *len = entry->len;
+  return arena->data + entry->value_offset;
+}
+
+int
+tdpkg_arena_release (const char* value)
+{
+  if (!arena || value < arena->data || value >= arena->data + arena->size)
+    return -1;
+  if (!--arena->n_borrowed && arena->retired)
+    tdpkg_arena_free ();
+  return 0;
+}
+
+/* the entry is left in place for the values still borrowed */
+void
+tdpkg_arena_forget (const char* key)
+{
+  if (!arena)
+    return;
+
+  struct ArenaEntry* entry = _arena_lookup (key);
+  if (entry)
+    entry->forgotten = 1;
+}
+
+void
+tdpkg_arena_free (void)
+{
+  if (!arena)
+    return;
+
+  /* values still borrowed would be left dangling */
+  if (arena->n_borrowed > 0)
+    {
+      arena->retired = 1;
+      return;
+    }
+
+  free (arena->data);
+  free (arena->entries);
+  free (arena->buckets);
+  free (arena);
+  arena = NULL;
+}
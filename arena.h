@@ -0,0 +1,38 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* The entries of the cache read in a single pass into a single buffer,
+   so that opening every list file in a row doesn't probe the backend for
+   each of them. The arena is released all at once. */
+
+int tdpkg_arena_load (void);
+/* the value stays valid until released, NULL if key is not there */
+const char* tdpkg_arena_get (const char* key, size_t* len);
+/* returns 0 if value belongs to the arena */
+int tdpkg_arena_release (const char* value);
+/* key has been changed in the backend */
+void tdpkg_arena_forget (const char* key);
+void tdpkg_arena_free (void);
+
+#endif
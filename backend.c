@@ -0,0 +1,255 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "backend.h"
+#include "util.h"
+#include "stats.h"
+
+#ifndef TDPKG_DEFAULT_BACKEND
+#define TDPKG_DEFAULT_BACKEND "packed"
+#endif
+
+static const TdpkgBackend* backends[] =
+{
+#ifdef TDPKG_BACKEND_PACKED
+  &tdpkg_backend_packed,
+#endif
+#ifdef TDPKG_BACKEND_SQLITE
+  &tdpkg_backend_sqlite,
+#endif
+#ifdef TDPKG_BACKEND_TOKYO
+  &tdpkg_backend_tokyo,
+#endif
+  NULL
+};
+
+static const TdpkgBackend* backend = NULL;
+/* see tdpkg_backend_generation */
+static unsigned int generation = 0;
+static int opened = 0;
+static int in_batch = 0;
+
+static const TdpkgBackend*
+_backend_lookup (const char* name)
+{
+  int i;
+  for (i=0; backends[i]; i++)
+    if (!strcmp (backends[i]->name, name))
+      return backends[i];
+  return NULL;
+}
+
+int
+tdpkg_backend_initialize (void)
+{
+  char configured[64];
+  const char* name = getenv ("TDPKG_BACKEND");
+  if ((!name || !*name) && !tdpkg_config ("backend", configured, sizeof (configured)))
+    name = configured;
+
+  backend = NULL;
+  if (name && *name)
+    {
+      backend = _backend_lookup (name);
+      if (!backend)
+        fprintf (stderr, "tdpkg: backend %s is not built in\n", name);
+    }
+  if (!backend)
+    backend = _backend_lookup (TDPKG_DEFAULT_BACKEND);
+  if (!backend)
+    backend = backends[0];
+  if (!backend)
+    {
+      fprintf (stderr, "tdpkg: no backend built in\n");
+      return -1;
+    }
+  return backend->initialize ();
+}
+
+char*
+tdpkg_backend_file (const char* name)
+{
+  char configured[4096];
+  const char* file = getenv ("TDPKG_CACHE_FILE");
+  if ((!file || !*file) && !tdpkg_config ("cache_file", configured, sizeof (configured)))
+    file = configured;
+  if (file && *file)
+    return strdup (file);
+
+  char base[64];
+  snprintf (base, sizeof (base), "tdpkg-%s.cache", name);
+  return tdpkg_admin_path (base);
+}
+
+const char*
+tdpkg_backend_name (void)
+{
+  return backend ? backend->name : "none";
+}
+
+int
+tdpkg_backend_open (int write)
+{
+  /* backends return right away when they're already open */
+  if (!opened)
+    generation++;
+  uint64_t start = tdpkg_stats_start ();
+  int result = backend->open (write);
+  tdpkg_stats_stop (TDPKG_TIMER_BACKEND_OPEN, start);
+  opened = !result;
+  return result;
+}
+
+int
+tdpkg_backend_open_fd (int fd)
+{
+  if (!backend->open_fd)
+    {
+      close (fd);
+      return -1;
+    }
+  generation++;
+  uint64_t start = tdpkg_stats_start ();
+  int result = backend->open_fd (fd);
+  tdpkg_stats_stop (TDPKG_TIMER_BACKEND_OPEN, start);
+  opened = !result;
+  return result;
+}
+
+int
+tdpkg_backend_share (void)
+{
+  if (!backend->open_fd)
+    return -1;
+  char* file = tdpkg_backend_file (backend->name);
+  int fd = open (file, O_RDONLY | O_CLOEXEC);
+  free (file);
+  return fd;
+}
+
+void
+tdpkg_backend_close (void)
+{
+  generation++;
+  opened = 0;
+  in_batch = 0;
+  backend->close ();
+}
+
+const char*
+tdpkg_backend_get (const char* key, size_t* len)
+{
+  uint64_t start = tdpkg_stats_start ();
+  const char* value = backend->get (key, len);
+  tdpkg_stats_stop (TDPKG_TIMER_BACKEND_GET, start);
+  return value;
+}
+
+void
+tdpkg_backend_release (const char* value)
+{
+  backend->release (value);
+}
+
+int
+tdpkg_backend_put (const char* key, const char* value, size_t len)
+{
+  /* a write of its own may publish a new cache */
+  if (!in_batch)
+    generation++;
+  uint64_t start = tdpkg_stats_start ();
+  int result = backend->put (key, value, len);
+  tdpkg_stats_stop (TDPKG_TIMER_BACKEND_PUT, start);
+  return result;
+}
+
+int
+tdpkg_backend_delete (const char* key)
+{
+  if (!in_batch)
+    generation++;
+  uint64_t start = tdpkg_stats_start ();
+  int result = backend->delete (key);
+  tdpkg_stats_stop (TDPKG_TIMER_BACKEND_DELETE, start);
+  return result;
+}
+
+int
+tdpkg_backend_begin (void)
+{
+  generation++;
+  uint64_t start = tdpkg_stats_start ();
+  int result = backend->begin ();
+  tdpkg_stats_stop (TDPKG_TIMER_BACKEND_BEGIN, start);
+  in_batch = !result;
+  return result;
+}
+
+int
+tdpkg_backend_begin_ordered (void)
+{
+  if (!backend->begin_ordered)
+    return 1;
+  generation++;
+  uint64_t start = tdpkg_stats_start ();
+  int result = backend->begin_ordered ();
+  tdpkg_stats_stop (TDPKG_TIMER_BACKEND_BEGIN, start);
+  in_batch = !result;
+  return result;
+}
+
+int
+tdpkg_backend_commit (void)
+{
+  uint64_t start = tdpkg_stats_start ();
+  int result = backend->commit ();
+  tdpkg_stats_stop (TDPKG_TIMER_BACKEND_COMMIT, start);
+  generation++;
+  in_batch = 0;
+  return result;
+}
+
+void
+tdpkg_backend_abort (void)
+{
+  backend->abort ();
+  generation++;
+  in_batch = 0;
+}
+
+unsigned int
+tdpkg_backend_generation (void)
+{
+  return generation;
+}
+
+int
+tdpkg_backend_foreach (size_t prefix, TdpkgBackendFunc func, void* data)
+{
+  uint64_t start = tdpkg_stats_start ();
+  int result = backend->foreach (prefix, func, data);
+  tdpkg_stats_stop (TDPKG_TIMER_BACKEND_FOREACH, start);
+  return result;
+}
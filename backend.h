@@ -0,0 +1,103 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stddef.h>
+
+/* Storage implemented by each cache-*.c, the cache logic lives in cache.c.
+   Values are opaque to backends. All functions returning int return 0
+   on success. */
+
+/* return non-zero to stop iterating, len is the full length of the value */
+typedef int (*TdpkgBackendFunc) (const char* key, const char* value, size_t len, void* data);
+
+typedef struct
+{
+  const char* name;
+  int (*initialize) (void);
+  /* a missing cache is not an error, it's just empty */
+  int (*open) (int write);
+  /* like open for reading, the cache being the read-only fd which is
+     owned by the backend from now on. NULL when the backend can't read
+     it from a descriptor */
+  int (*open_fd) (int fd);
+  void (*close) (void);
+  /* values stay valid until released, even across writes */
+  const char* (*get) (const char* key, size_t* len);
+  void (*release) (const char* value);
+  int (*put) (const char* key, const char* value, size_t len);
+  int (*delete) (const char* key);
+  /* writes between begin and commit are made durable at once, and other
+     processes see either all of them or none. begin starts from what was
+     last committed by any process, the caller makes sure that only one
+     process writes at a time */
+  int (*begin) (void);
+  /* like begin, but the cache is replaced by the values put before
+     commit, stored in the order they're put. get and foreach still
+     see what was committed before. NULL when the backend can't choose
+     where values are stored */
+  int (*begin_ordered) (void);
+  int (*commit) (void);
+  void (*abort) (void);
+  /* when prefix is not 0 only the first prefix bytes of each value are
+     needed, the rest may not be passed to func */
+  int (*foreach) (size_t prefix, TdpkgBackendFunc func, void* data);
+} TdpkgBackend;
+
+extern const TdpkgBackend tdpkg_backend_packed;
+extern const TdpkgBackend tdpkg_backend_sqlite;
+extern const TdpkgBackend tdpkg_backend_tokyo;
+
+/* the cache of the backend name: TDPKG_CACHE_FILE, cache_file in
+   CONFIG_FILE or tdpkg-<name>.cache in the admin directory, newly
+   allocated */
+char* tdpkg_backend_file (const char* name);
+/* the name of the backend in use */
+const char* tdpkg_backend_name (void);
+
+/* the backends built in are listed in backend.c, initialize picks the
+   one named by TDPKG_BACKEND or by CONFIG_FILE, see README */
+int tdpkg_backend_initialize (void);
+int tdpkg_backend_open (int write);
+/* fd is closed when the backend has no open_fd */
+int tdpkg_backend_open_fd (int fd);
+/* a read-only descriptor of the cache file for open_fd, -1 if the backend
+   can't be opened from one or there's no cache */
+int tdpkg_backend_share (void);
+void tdpkg_backend_close (void);
+const char* tdpkg_backend_get (const char* key, size_t* len);
+void tdpkg_backend_release (const char* value);
+int tdpkg_backend_put (const char* key, const char* value, size_t len);
+int tdpkg_backend_delete (const char* key);
+int tdpkg_backend_begin (void);
+/* returns 1 without beginning a batch when the backend has no begin_ordered */
+int tdpkg_backend_begin_ordered (void);
+int tdpkg_backend_commit (void);
+void tdpkg_backend_abort (void);
+int tdpkg_backend_foreach (size_t prefix, TdpkgBackendFunc func, void* data);
+/* changes whenever values got from now on may come from another cache
+   than the ones got before, i.e. when the backend is opened, a batch is
+   begun or ended, or a write outside a batch commits on its own. Values
+   of other processes may show up in between with backends reading the
+   cache in place, like sqlite */
+unsigned int tdpkg_backend_generation (void);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Generates a synthetic dpkg admin directory: a status file and one list
+   file per package, with paths laid out like those of a Debian system.
+   The same seed always gives the same tree. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#define MAX_FILES 30000
+
+static uint64_t seed = 1;
+
+/* xorshift64*, not rand() so that the tree doesn't depend on the libc */
+static uint32_t
+_gen_random (void)
+{
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return (seed * 2685821657736338717ULL) >> 32;
+}
+
+static double
+_gen_uniform (void)
+{
+  return (_gen_random () + 1.0) / 4294967297.0;
+}
+
+static void
+_gen_word (char* buf, int min, int max)
+{
+  static const char* syllables[] = { "ba", "co", "de", "fi", "gu", "ha", "ki", "lo", "ma", "ne",
+                                     "po", "qu", "ra", "si", "tu", "vo", "xe", "zy", "li", "b" };
+  int len = min + _gen_random () % (max - min + 1);
+  buf[0] = '\0';
+  while ((int)strlen (buf) < len)
+    strcat (buf, syllables[_gen_random () % 20]);
+}
+
+struct Paths
+{
+  char** paths;
+  int n_paths;
+  int alloc;
+};
+
+static void
+_gen_add (struct Paths* paths, const char* path)
+{
+  if (paths->n_paths == paths->alloc)
+    {
+      paths->alloc = paths->alloc ? paths->alloc*2 : 64;
+      paths->paths = realloc (paths->paths, paths->alloc * sizeof (char*));
+    }
+  paths->paths[paths->n_paths++] = strdup (path);
+}
+
+/* every parent directory is listed too, like in real list files */
+static void
+_gen_add_file (struct Paths* paths, const char* path)
+{
+  char dir[4096];
+  const char* slash;
+  for (slash = strchr (path+1, '/'); slash; slash = strchr (slash+1, '/'))
+    {
+      memcpy (dir, path, slash-path);
+      dir[slash-path] = '\0';
+      _gen_add (paths, dir);
+    }
+  _gen_add (paths, path);
+}
+
+static int
+_gen_compare (const void* a, const void* b)
+{
+  return strcmp (*(char* const*)a, *(char* const*)b);
+}
+
+/* most packages ship a handful of files, a few ship thousands */
+static int
+_gen_n_files (void)
+{
+  double n = 6.0 / _gen_uniform ();
+  return n > MAX_FILES ? MAX_FILES : (int)n;
+}
+
+static void
+_gen_package (struct Paths* paths, const char* name)
+{
+  static const char* exts[] = { "", ".gz", ".so", ".py", ".png", ".h", ".html", ".mo", ".conf", ".pm" };
+  static const char* triplet = "/usr/lib/x86_64-linux-gnu";
+  char path[4096];
+  char word[64];
+  char sub[64];
+
+  _gen_add (paths, "/.");
+  snprintf (path, sizeof (path), "/usr/share/doc/%s/copyright", name);
+  _gen_add_file (paths, path);
+  snprintf (path, sizeof (path), "/usr/share/doc/%s/changelog.Debian.gz", name);
+  _gen_add_file (paths, path);
+
+  int kind = _gen_random () % 4;
+  int n_files = _gen_n_files ();
+  int i;
+  for (i=0; i < n_files; i++)
+    {
+      _gen_word (word, 3, 12);
+      const char* ext = exts[_gen_random () % 10];
+      int r = _gen_random () % 100;
+      if (kind == 0 && r < 60)
+        snprintf (path, sizeof (path), "%s/lib%s.so.%d", triplet, word, (int)(_gen_random () % 9));
+      else if (kind == 1 && r < 30)
+        snprintf (path, sizeof (path), "/usr/bin/%s", word);
+      else if (kind == 1 && r < 50)
+        snprintf (path, sizeof (path), "/usr/share/man/man1/%s.1.gz", word);
+      else if (kind == 2 && r < 70)
+        {
+          _gen_word (sub, 2, 8);
+          snprintf (path, sizeof (path), "/usr/lib/python3/dist-packages/%s/%s/%s.py", name, sub, word);
+        }
+      else if (r < 85)
+        {
+          int depth = 1 + _gen_random () % 4;
+          int len = snprintf (path, sizeof (path), "/usr/share/%s", name);
+          while (depth-- > 0)
+            {
+              _gen_word (sub, 2, 8);
+              len += snprintf (path+len, sizeof (path)-len, "/%s", sub);
+            }
+          snprintf (path+len, sizeof (path)-len, "/%s%s", word, ext);
+        }
+      else
+        snprintf (path, sizeof (path), "/usr/share/locale/%.2s/LC_MESSAGES/%s.mo", word, name);
+      _gen_add_file (paths, path);
+    }
+}
+
+static int
+_gen_write_list (const char* info_dir, const char* name, struct Paths* paths)
+{
+  char filename[4096+64];
+  snprintf (filename, sizeof (filename), "%s/%s.list", info_dir, name);
+  FILE* file = fopen (filename, "w");
+  if (!file)
+    {
+      fprintf (stderr, "mkadmindir: can't create %s: %s\n", filename, strerror (errno));
+      return -1;
+    }
+
+  qsort (paths->paths, paths->n_paths, sizeof (char*), _gen_compare);
+  int i;
+  for (i=0; i < paths->n_paths; i++)
+    {
+      if (!i || strcmp (paths->paths[i], paths->paths[i-1]))
+        fprintf (file, "%s\n", paths->paths[i]);
+    }
+  for (i=0; i < paths->n_paths; i++)
+    free (paths->paths[i]);
+  paths->n_paths = 0;
+
+  if (fclose (file))
+    {
+      fprintf (stderr, "mkadmindir: can't write %s: %s\n", filename, strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+static int
+_gen_mkdir (const char* dir)
+{
+  if (mkdir (dir, 0755) && errno != EEXIST)
+    {
+      fprintf (stderr, "mkadmindir: can't create %s: %s\n", dir, strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+static void
+_gen_usage (void)
+{
+  fprintf (stderr, "usage: mkadmindir [-n packages] [-s seed] admindir\n");
+  exit (2);
+}
+
+int
+main (int argc, char** argv)
+{
+  int n_packages = 2000;
+  int opt;
+  while ((opt = getopt (argc, argv, "n:s:")) != -1)
+    {
+      if (opt == 'n')
+        n_packages = atoi (optarg);
+      else if (opt == 's')
+        seed = strtoull (optarg, NULL, 10) | 1;
+      else
+        _gen_usage ();
+    }
+  if (optind != argc-1 || n_packages <= 0)
+    _gen_usage ();
+
+  const char* admin_dir = argv[optind];
+  char info_dir[4096];
+  char filename[4096];
+  snprintf (info_dir, sizeof (info_dir), "%s/info", admin_dir);
+  snprintf (filename, sizeof (filename), "%s/updates", admin_dir);
+  if (_gen_mkdir (admin_dir) || _gen_mkdir (info_dir) || _gen_mkdir (filename))
+    return 1;
+
+  snprintf (filename, sizeof (filename), "%s/status", admin_dir);
+  FILE* status = fopen (filename, "w");
+  if (!status)
+    {
+      fprintf (stderr, "mkadmindir: can't create %s: %s\n", filename, strerror (errno));
+      return 1;
+    }
+
+  struct Paths paths;
+  memset (&paths, '\0', sizeof (paths));
+  char name[32];
+  char word[64];
+  int i;
+  for (i=0; i < n_packages; i++)
+    {
+      _gen_word (word, 3, 10);
+      snprintf (name, sizeof (name), "%.16s%d", word, i);
+      _gen_package (&paths, name);
+      if (_gen_write_list (info_dir, name, &paths))
+        return 1;
+      fprintf (status, "Package: %s\nStatus: install ok installed\nPriority: optional\n"
+               "Section: misc\nMaintainer: tdpkg <tdpkg@localhost>\nArchitecture: all\n"
+               "Version: 1.0\nDescription: synthetic package %d\n\n", name, i);
+    }
+  free (paths.paths);
+
+  if (fclose (status))
+    {
+      fprintf (stderr, "mkadmindir: can't write %s/status: %s\n", admin_dir, strerror (errno));
+      return 1;
+    }
+  return 0;
+}
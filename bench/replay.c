@@ -0,0 +1,298 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Replays the accesses of dpkg to its files database, to be run with
+   libtdpkg.so preloaded: every list file of the admin directory is opened,
+   fstat'ed, read and closed, then some are rewritten the way dpkg does
+   when installing packages. Prints latencies, system calls and memory. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define MARKER "/usr/share/doc/tdpkg-replay-marker"
+
+static double
+_replay_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+_replay_compare_name (const void* a, const void* b)
+{
+  return strcmp (*(char* const*)a, *(char* const*)b);
+}
+
+static int
+_replay_compare_double (const void* a, const void* b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static double
+_replay_percentile (double* sorted, int n, double p)
+{
+  if (!n)
+    return 0;
+  int i = (int)(p * (n-1) + 0.5);
+  return sorted[i];
+}
+
+/* read and write system calls done so far, from /proc/self/io */
+static long
+_replay_syscalls (void)
+{
+  FILE* file = fopen ("/proc/self/io", "r");
+  if (!file)
+    return -1;
+  long total = 0;
+  long value;
+  char key[64];
+  while (fscanf (file, "%63[^:]: %ld\n", key, &value) == 2)
+    if (!strcmp (key, "syscr") || !strcmp (key, "syscw"))
+      total += value;
+  fclose (file);
+  return total;
+}
+
+/* like fd_read() of dpkg, after fstat() */
+static int
+_replay_load (const char* filename)
+{
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+      fprintf (stderr, "replay: can't open %s: %s\n", filename, strerror (errno));
+      return -1;
+    }
+
+  struct stat stat_buf;
+  if (fstat (fd, &stat_buf))
+    {
+      fprintf (stderr, "replay: can't stat %s: %s\n", filename, strerror (errno));
+      close (fd);
+      return -1;
+    }
+
+  char* buf = malloc (stat_buf.st_size + 1);
+  off_t done = 0;
+  while (done < stat_buf.st_size)
+    {
+      ssize_t n = read (fd, buf + done, stat_buf.st_size - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        {
+          fprintf (stderr, "replay: can't read %s: %s\n", filename, n ? strerror (errno) : "short read");
+          free (buf);
+          close (fd);
+          return -1;
+        }
+      done += n;
+    }
+  free (buf);
+  close (fd);
+  return 0;
+}
+
+static char*
+_replay_read_all (const char* filename, size_t* len)
+{
+  FILE* file = fopen (filename, "r");
+  if (!file)
+    return NULL;
+  size_t alloc = 4096;
+  char* contents = malloc (alloc);
+  *len = 0;
+  size_t n;
+  while ((n = fread (contents + *len, 1, alloc - *len, file)) > 0)
+    {
+      *len += n;
+      if (*len == alloc)
+        contents = realloc (contents, alloc *= 2);
+    }
+  fclose (file);
+  return contents;
+}
+
+/* like write_filelist_except() of dpkg: the list file is written to
+   .list-new, synced and renamed. The marker path is added or removed so
+   that the contents change every time. With reinstall the list file is
+   removed first, like when a package is purged and installed again. */
+static int
+_replay_rewrite (const char* filename, int reinstall)
+{
+  size_t len;
+  char* contents = _replay_read_all (filename, &len);
+  if (!contents)
+    {
+      fprintf (stderr, "replay: can't read %s: %s\n", filename, strerror (errno));
+      return -1;
+    }
+
+  size_t marker_len = strlen (MARKER "\n");
+  int marked = len >= marker_len && !memcmp (contents + len - marker_len, MARKER "\n", marker_len);
+  if (marked)
+    len -= marker_len;
+
+  if (reinstall && unlink (filename))
+    {
+      fprintf (stderr, "replay: can't remove %s: %s\n", filename, strerror (errno));
+      free (contents);
+      return -1;
+    }
+
+  char newname[4096];
+  snprintf (newname, sizeof (newname), "%s-new", filename);
+  FILE* file = fopen (newname, "w");
+  if (!file)
+    {
+      fprintf (stderr, "replay: can't create %s: %s\n", newname, strerror (errno));
+      free (contents);
+      return -1;
+    }
+  fwrite (contents, 1, len, file);
+  if (!marked)
+    fputs (MARKER "\n", file);
+  free (contents);
+  if (fflush (file) || fsync (fileno (file)) || fclose (file) || rename (newname, filename))
+    {
+      fprintf (stderr, "replay: can't write %s: %s\n", filename, strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+static void
+_replay_usage (void)
+{
+  fprintf (stderr, "usage: replay [-l label] [-c churn] [-s seed] admindir\n");
+  exit (2);
+}
+
+int
+main (int argc, char** argv)
+{
+  const char* label = "run";
+  int churn = 0;
+  unsigned int seed = 1;
+  int opt;
+  while ((opt = getopt (argc, argv, "l:c:s:")) != -1)
+    {
+      if (opt == 'l')
+        label = optarg;
+      else if (opt == 'c')
+        churn = atoi (optarg);
+      else if (opt == 's')
+        seed = atoi (optarg);
+      else
+        _replay_usage ();
+    }
+  if (optind != argc-1)
+    _replay_usage ();
+
+  char info_dir[4096];
+  snprintf (info_dir, sizeof (info_dir), "%s/info", argv[optind]);
+  DIR* dir = opendir (info_dir);
+  if (!dir)
+    {
+      fprintf (stderr, "replay: can't open %s: %s\n", info_dir, strerror (errno));
+      return 1;
+    }
+
+  /* dpkg goes through packages by name */
+  char** filenames = NULL;
+  int n_filenames = 0;
+  struct dirent* entry;
+  while ((entry = readdir (dir)))
+    {
+      size_t len = strlen (entry->d_name);
+      if (len < 6 || strcmp (entry->d_name + len - 5, ".list"))
+        continue;
+      filenames = realloc (filenames, (n_filenames+1) * sizeof (char*));
+      if (asprintf (&filenames[n_filenames], "%s/%s", info_dir, entry->d_name) < 0)
+        return 1;
+      n_filenames++;
+    }
+  closedir (dir);
+  if (!n_filenames)
+    {
+      fprintf (stderr, "replay: no list files in %s\n", info_dir);
+      return 1;
+    }
+  qsort (filenames, n_filenames, sizeof (char*), _replay_compare_name);
+
+  long syscalls = _replay_syscalls ();
+  double* load = malloc (n_filenames * sizeof (double));
+  double start = _replay_now ();
+  int i;
+  for (i=0; i < n_filenames; i++)
+    {
+      double t = _replay_now ();
+      if (_replay_load (filenames[i]))
+        return 1;
+      load[i] = _replay_now () - t;
+    }
+  double load_total = _replay_now () - start;
+
+  double* rewrite = malloc ((churn ? churn : 1) * sizeof (double));
+  srand (seed);
+  for (i=0; i < churn; i++)
+    {
+      double t = _replay_now ();
+      if (_replay_rewrite (filenames[rand () % n_filenames], i % 4 == 3))
+        return 1;
+      rewrite[i] = _replay_now () - t;
+    }
+  syscalls = _replay_syscalls () - syscalls;
+
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  qsort (load, n_filenames, sizeof (double), _replay_compare_double);
+  qsort (rewrite, churn, sizeof (double), _replay_compare_double);
+  printf ("%-16s files=%d load_ms=%.1f p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.0f",
+          label, n_filenames, load_total / 1e3,
+          _replay_percentile (load, n_filenames, 0.5), _replay_percentile (load, n_filenames, 0.9),
+          _replay_percentile (load, n_filenames, 0.99), load[n_filenames-1]);
+  if (churn)
+    printf (" churn=%d churn_p50_us=%.1f churn_p99_us=%.1f", churn,
+            _replay_percentile (rewrite, churn, 0.5), _replay_percentile (rewrite, churn, 0.99));
+  printf (" syscalls=%ld rss_kb=%ld majflt=%ld\n", syscalls, usage.ru_maxrss, usage.ru_majflt);
+
+  for (i=0; i < n_filenames; i++)
+    free (filenames[i]);
+  free (filenames);
+  free (load);
+  free (rewrite);
+  return 0;
+}
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Benchmarks libtdpkg.so on a synthetic admin directory, for each backend:
+#   build   first run, the cache doesn't exist
+#   cold    page cache dropped before each run, only when run as root
+#   warm    the cache is up to date and in memory
+#   churn   list files are rewritten like dpkg -i does
+#   stale   first run after the churn
+#   layout  cold runs once the cache is laid out in the order replay reads
+#           it, see TDPKG_LAYOUT in README
+# Settings are taken from the environment, the defaults are shown below.
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+ADMINDIR=${ADMINDIR:-$BENCH/admindir}
+PACKAGES=${PACKAGES:-2000}
+BACKENDS=${BACKENDS:-"packed sqlite tokyo"}
+LIB=${LIB:-$BENCH/../libtdpkg.so}
+RUNS=${RUNS:-3}
+CHURN=${CHURN:-50}
+
+if [ ! -d "$ADMINDIR/info" ]; then
+  "$BENCH/mkadmindir" -n "$PACKAGES" "$ADMINDIR" || exit 1
+fi
+
+cold=0
+if [ -w /proc/sys/vm/drop_caches ]; then
+  cold=1
+else
+  echo "# not root, skipping cold runs" >&2
+fi
+
+replay ()
+{
+  DPKG_ADMINDIR=$ADMINDIR LD_PRELOAD=$preload TDPKG_BACKEND=$backend TDPKG_LAYOUT=$layout \
+    "$BENCH/replay" "$@" "$ADMINDIR" | tr '\r' '\n' | grep -v '^tdpkg'
+}
+
+drop_caches ()
+{
+  sync
+  echo 3 > /proc/sys/vm/drop_caches
+}
+
+layout=0
+for backend in none $BACKENDS; do
+  preload=$LIB
+  [ $backend = none ] && preload=
+  rm -f "$ADMINDIR"/tdpkg-$backend.cache* "$ADMINDIR"/tdpkg.order
+
+  replay -l $backend/build || continue
+  i=0
+  while [ $i -lt $RUNS ]; do
+    if [ $cold = 1 ]; then
+      drop_caches
+      replay -l $backend/cold
+    fi
+    i=$((i+1))
+  done
+  i=0
+  while [ $i -lt $RUNS ]; do
+    replay -l $backend/warm
+    i=$((i+1))
+  done
+  replay -l $backend/churn -c $CHURN -s 1
+  replay -l $backend/stale
+  # the marker paths added by the churn are removed again
+  replay -l $backend/churn -c $CHURN -s 1 > /dev/null
+  if [ $cold = 1 ] && [ $backend != none ]; then
+    layout=1
+    replay -l $backend/record > /dev/null
+    i=0
+    while [ $i -lt $RUNS ]; do
+      drop_caches
+      replay -l $backend/layout
+      i=$((i+1))
+    done
+    layout=0
+  fi
+  rm -f "$ADMINDIR"/tdpkg-$backend.cache* "$ADMINDIR"/tdpkg.order
+done
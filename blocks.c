@@ -0,0 +1,230 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "blocks.h"
+
+/* Layout: uint64 len, uint32 block size, uint32 number of blocks, the
+   uint32 end offset of each block within the data, then the data. */
+#define BLOCKS_HEADER_SIZE (sizeof (uint64_t) + 2*sizeof (uint32_t))
+#define BLOCKS_MAX_SIZE (1024*1024)
+
+/* deflate works best with the most frequent strings at the end */
+static const char dictionary[] =
+  "/usr/share/perl5//usr/lib/python3/dist-packages//usr/share/vim/"
+  "/usr/include/boost//usr/share/cmake/Modules//usr/lib/systemd/system/"
+  "/etc/init.d//etc/default//usr/share/info//usr/share/lintian/overrides/"
+  "/usr/share/bash-completion/completions//usr/share/icons/hicolor/"
+  "/usr/share/applications//usr/share/pixmaps//usr/share/man/man5/"
+  "/usr/share/man/man7//usr/share/man/man8//usr/sbin//usr/lib/"
+  ".html.txt.pm.pl.so.js.py.h.hpp.mo/__init__.py/__pycache__/"
+  "/usr/share/doc//usr/bin//usr/share/man/man1//usr/lib/x86_64-linux-gnu/"
+  "/usr/share/man/man3//LC_MESSAGES//usr/share/locale/"
+  "/changelog.Debian.gz/copyright/usr/share/doc/"
+  "/.\n/usr\n/usr/share\n";
+
+static int
+_blocks_deflate_init (z_stream* stream)
+{
+  memset (stream, '\0', sizeof (z_stream));
+  if (deflateInit2 (stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+  return 0;
+}
+
+char*
+tdpkg_blocks_compress (const char* contents, size_t len, size_t offset, size_t* compressed_len)
+{
+  z_stream stream;
+  if (_blocks_deflate_init (&stream))
+    {
+      fprintf (stderr, "tdpkg: can't initialize zlib\n");
+      return NULL;
+    }
+
+  uint32_t n_blocks = (len + BLOCKS_SIZE - 1) / BLOCKS_SIZE;
+  size_t table_size = BLOCKS_HEADER_SIZE + n_blocks * sizeof (uint32_t);
+  size_t bound = table_size;
+  uint32_t i;
+  for (i=0; i < n_blocks; i++)
+    bound += deflateBound (&stream, BLOCKS_SIZE);
+
+  char* value = malloc (offset + bound);
+  char* header = value + offset;
+  uint64_t len64 = len;
+  uint32_t block_size = BLOCKS_SIZE;
+  memcpy (header, &len64, sizeof (len64));
+  memcpy (header + sizeof (len64), &block_size, sizeof (block_size));
+  memcpy (header + sizeof (len64) + sizeof (block_size), &n_blocks, sizeof (n_blocks));
+
+  char* data = header + table_size;
+  uint32_t end = 0;
+  for (i=0; i < n_blocks; i++)
+    {
+      size_t block_len = len - (size_t)i*BLOCKS_SIZE;
+      if (block_len > BLOCKS_SIZE)
+        block_len = BLOCKS_SIZE;
+
+      deflateReset (&stream);
+      deflateSetDictionary (&stream, (const Bytef*) dictionary, sizeof (dictionary) - 1);
+      stream.next_in = (Bytef*) contents + (size_t)i*BLOCKS_SIZE;
+      stream.avail_in = block_len;
+      stream.next_out = (Bytef*) data + end;
+      stream.avail_out = bound - table_size - end;
+      if (deflate (&stream, Z_FINISH) != Z_STREAM_END)
+        {
+          fprintf (stderr, "tdpkg: can't compress block %u\n", i);
+          deflateEnd (&stream);
+          free (value);
+          return NULL;
+        }
+
+      end += stream.total_out;
+      memcpy (header + BLOCKS_HEADER_SIZE + i*sizeof (uint32_t), &end, sizeof (end));
+    }
+  deflateEnd (&stream);
+
+  *compressed_len = table_size + end;
+  return value;
+}
+
+/* the value comes from the cache file, nothing in it is trusted */
+int
+tdpkg_blocks_open (TdpkgBlocks* blocks, const char* value, size_t len)
+{
+  memset (blocks, '\0', sizeof (TdpkgBlocks));
+  if (len < BLOCKS_HEADER_SIZE)
+    return -1;
+  memcpy (&blocks->len, value, sizeof (uint64_t));
+  memcpy (&blocks->block_size, value + sizeof (uint64_t), sizeof (uint32_t));
+  memcpy (&blocks->n_blocks, value + sizeof (uint64_t) + sizeof (uint32_t), sizeof (uint32_t));
+
+  if (!blocks->block_size || blocks->block_size > BLOCKS_MAX_SIZE
+      || blocks->n_blocks != (blocks->len + blocks->block_size - 1) / blocks->block_size
+      || (len - BLOCKS_HEADER_SIZE) / sizeof (uint32_t) < blocks->n_blocks)
+    return -1;
+
+  size_t table_size = BLOCKS_HEADER_SIZE + blocks->n_blocks * sizeof (uint32_t);
+  blocks->ends = value + BLOCKS_HEADER_SIZE;
+  blocks->data = value + table_size;
+  blocks->data_len = len - table_size;
+  blocks->block_index = -1;
+
+  /* the last block ends the value, unless it's been truncated */
+  uint32_t end = 0;
+  if (blocks->n_blocks)
+    memcpy (&end, blocks->ends + (blocks->n_blocks-1)*sizeof (uint32_t), sizeof (uint32_t));
+  return end == blocks->data_len ? 0 : -1;
+}
+
+static int
+_blocks_inflate (TdpkgBlocks* blocks, uint32_t index, char* buf, size_t block_len)
+{
+  uint32_t start = 0;
+  uint32_t end;
+  if (index > 0)
+    memcpy (&start, blocks->ends + (index-1)*sizeof (uint32_t), sizeof (uint32_t));
+  memcpy (&end, blocks->ends + index*sizeof (uint32_t), sizeof (uint32_t));
+  if (start > end || end > blocks->data_len)
+    return -1;
+
+  if (!blocks->has_stream)
+    {
+      if (inflateInit2 (&blocks->stream, -MAX_WBITS) != Z_OK)
+        return -1;
+      blocks->has_stream = 1;
+    }
+  else
+    inflateReset (&blocks->stream);
+
+  inflateSetDictionary (&blocks->stream, (const Bytef*) dictionary, sizeof (dictionary) - 1);
+  blocks->stream.next_in = (Bytef*) blocks->data + start;
+  blocks->stream.avail_in = end - start;
+  blocks->stream.next_out = (Bytef*) buf;
+  blocks->stream.avail_out = block_len;
+  if (inflate (&blocks->stream, Z_FINISH) != Z_STREAM_END || blocks->stream.avail_out)
+    return -1;
+  return 0;
+}
+
+/* whole blocks are inflated right into buf, only the partial ones at
+   the edges go through the block buffer */
+ssize_t
+tdpkg_blocks_pread (TdpkgBlocks* blocks, void* buf, size_t nbyte, uint64_t offset)
+{
+  if (offset >= blocks->len)
+    return 0;
+  if (nbyte > blocks->len - offset)
+    nbyte = blocks->len - offset;
+
+  size_t done = 0;
+  while (done < nbyte)
+    {
+      uint64_t pos = offset + done;
+      uint32_t index = pos / blocks->block_size;
+      size_t in_block = pos % blocks->block_size;
+      size_t block_len = blocks->len - (uint64_t)index*blocks->block_size;
+      if (block_len > blocks->block_size)
+        block_len = blocks->block_size;
+      size_t n = block_len - in_block;
+      if (n > nbyte - done)
+        n = nbyte - done;
+
+      if (!in_block && n == block_len)
+        {
+          if (_blocks_inflate (blocks, index, (char*) buf + done, block_len))
+            {
+              errno = EIO;
+              return -1;
+            }
+        }
+      else
+        {
+          if (blocks->block_index != index)
+            {
+              if (!blocks->block)
+                blocks->block = malloc (blocks->block_size);
+              blocks->block_index = -1;
+              if (_blocks_inflate (blocks, index, blocks->block, block_len))
+                {
+                  errno = EIO;
+                  return -1;
+                }
+              blocks->block_index = index;
+            }
+          memcpy ((char*) buf + done, blocks->block + in_block, n);
+        }
+      done += n;
+    }
+  return done;
+}
+
+void
+tdpkg_blocks_close (TdpkgBlocks* blocks)
+{
+  if (blocks->has_stream)
+    inflateEnd (&blocks->stream);
+  free (blocks->block);
+  blocks->block = NULL;
+  blocks->has_stream = 0;
+}
@@ -0,0 +1,56 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOCKS_H
+#define BLOCKS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/* Block-compressed contents: split in blocks of BLOCKS_SIZE bytes, each
+   deflated on its own with a preset dictionary of common paths, so that
+   any range can be read by inflating only the blocks it covers. */
+#define BLOCKS_SIZE 16384
+
+typedef struct
+{
+  const char* ends;
+  const char* data;
+  size_t data_len;
+  uint64_t len;
+  uint32_t block_size;
+  uint32_t n_blocks;
+  z_stream stream;
+  int has_stream;
+  /* the last block inflated for a partial read */
+  char* block;
+  int64_t block_index;
+} TdpkgBlocks;
+
+/* returns a buffer with offset bytes left free followed by the compressed
+   contents, compressed_len doesn't count offset */
+char* tdpkg_blocks_compress (const char* contents, size_t len, size_t offset, size_t* compressed_len);
+/* value must stay valid until the blocks are closed */
+int tdpkg_blocks_open (TdpkgBlocks* blocks, const char* value, size_t len);
+ssize_t tdpkg_blocks_pread (TdpkgBlocks* blocks, void* buf, size_t nbyte, uint64_t offset);
+void tdpkg_blocks_close (TdpkgBlocks* blocks);
+
+#endif
@@ -0,0 +1,600 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "backend.h"
+#include "util.h"
+
+/* The cache is a single read-only file, mapped once:
+     header | keys and values | buckets | entries
+   buckets is an open addressing table of entry indexes, every key and
+   value is followed by a '\0'. Writes stream a whole new file, copying
+   unchanged values from the current mapping, and rename it into place.
+   Values are stored in the order they're put, followed by the copies.
+   Readers keep the file they mapped until they write themselves. */
+#define PACKED_MAGIC "TDPKGPK2"
+#define PACKED_EMPTY 0xffffffff
+
+struct PackedHeader
+{
+  char magic[8];
+  uint32_t n_buckets;
+  uint32_t n_entries;
+  uint64_t size;
+  uint64_t tables_offset;
+};
+
+struct PackedEntry
+{
+  uint32_t hash;
+  uint32_t key_len;
+  uint64_t key_offset;
+  uint64_t data_offset;
+  uint64_t data_len;
+};
+
+/* a put or delete done in the current batch */
+struct PackedChange
+{
+  char* key;
+  uint32_t hash;
+  int entry;
+};
+
+struct PackedWriter
+{
+  FILE* file;
+  uint64_t offset;
+  struct PackedEntry* entries;
+  uint32_t n_entries;
+  struct PackedChange* changes;
+  uint32_t n_changes;
+  /* entries of the current cache not changed are copied on commit */
+  int keep;
+};
+
+struct PackedMap
+{
+  const char* addr;
+  size_t size;
+};
+
+static const char* map = NULL;
+static size_t map_size = 0;
+static const struct PackedHeader* header;
+static const uint32_t* buckets;
+static const struct PackedEntry* entries;
+static int opened = 0;
+
+static struct PackedWriter* writer = NULL;
+
+/* borrowed values point into the mapping, replaced mappings are
+   kept until every borrowed pointer has been released */
+static int n_borrowed = 0;
+static struct PackedMap* retired = NULL;
+static int n_retired = 0;
+
+static char* cache_file = NULL;
+static char* cache_tmp_file = NULL;
+
+static uint32_t
+_packed_n_buckets (uint32_t n_entries)
+{
+  uint32_t n_buckets = 16;
+  while (n_buckets < n_entries*2)
+    n_buckets <<= 1;
+  return n_buckets;
+}
+
+static void
+_packed_unmap_retired (void)
+{
+  int i;
+  for (i=0; i < n_retired; i++)
+    munmap ((void*)retired[i].addr, retired[i].size);
+  free (retired);
+  retired = NULL;
+  n_retired = 0;
+}
+
+static void
+_packed_unmap (void)
+{
+  if (map && n_borrowed > 0)
+    {
+      retired = realloc (retired, (n_retired+1) * sizeof (struct PackedMap));
+      retired[n_retired].addr = map;
+      retired[n_retired].size = map_size;
+      n_retired++;
+    }
+  else if (map)
+    munmap ((void*)map, map_size);
+  map = NULL;
+  map_size = 0;
+  header = NULL;
+  buckets = NULL;
+  entries = NULL;
+}
+
+/* returns 0 on success, -1 if the cache is not valid */
+static int
+_packed_map_fd (int fd)
+{
+  /* fstat has been wrapped, but the size is all that's needed */
+  off_t end = lseek (fd, 0, SEEK_END);
+  if (end < 0)
+    {
+      fprintf (stderr, "tdpkg packed: can't seek %s: %s\n", cache_file, strerror (errno));
+      return -1;
+    }
+
+  size_t size = end;
+  if (size < sizeof (struct PackedHeader))
+    return -1;
+
+  void* addr = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    {
+      fprintf (stderr, "tdpkg packed: can't map %s: %s\n", cache_file, strerror (errno));
+      return -1;
+    }
+
+  const struct PackedHeader* h = addr;
+  uint64_t tables_size = (uint64_t)h->n_buckets * sizeof (uint32_t)
+    + (uint64_t)h->n_entries * sizeof (struct PackedEntry);
+  if (memcmp (h->magic, PACKED_MAGIC, sizeof (h->magic)) || h->size != size
+      || !h->n_buckets || (h->n_buckets & (h->n_buckets-1))
+      || h->n_entries > h->n_buckets || h->tables_offset % 8
+      || h->tables_offset < sizeof (struct PackedHeader)
+      || h->tables_offset + tables_size > size)
+    {
+      fprintf (stderr, "tdpkg packed: %s is not a valid cache\n", cache_file);
+      munmap (addr, size);
+      return -1;
+    }
+
+  map = addr;
+  map_size = size;
+  header = h;
+  buckets = (const uint32_t*)(map + h->tables_offset);
+  entries = (const struct PackedEntry*)(buckets + h->n_buckets);
+  return 0;
+}
+
+/* returns 0 on success, -1 if the cache is missing or not valid */
+static int
+_packed_map (void)
+{
+  struct stat stat_buf;
+  if (tdpkg_stat (cache_file, &stat_buf))
+    return -1;
+
+  FILE* file = fopen (cache_file, "r");
+  if (!file)
+    {
+      fprintf (stderr, "tdpkg packed: can't open %s: %s\n", cache_file, strerror (errno));
+      return -1;
+    }
+
+  int result = _packed_map_fd (fileno (file));
+  fclose (file);
+  return result;
+}
+
+static int
+_packed_entry_valid (const struct PackedEntry* entry)
+{
+  return entry->key_offset + entry->key_len < map_size
+    && entry->data_offset + entry->data_len < map_size;
+}
+
+static const struct PackedEntry*
+_packed_lookup (const char* key)
+{
+  if (!map)
+    return NULL;
+
+  size_t len = strlen (key);
+  uint32_t hash = tdpkg_hash (key, len);
+  uint32_t mask = header->n_buckets-1;
+  uint32_t i;
+  for (i = hash & mask; buckets[i] != PACKED_EMPTY; i = (i+1) & mask)
+    {
+      if (buckets[i] >= header->n_entries)
+        return NULL;
+      const struct PackedEntry* entry = &entries[buckets[i]];
+      if (entry->hash != hash || entry->key_len != len)
+        continue;
+      if (!_packed_entry_valid (entry))
+        return NULL;
+      if (!memcmp (map + entry->key_offset, key, len))
+        return entry;
+    }
+  return NULL;
+}
+
+static int
+_packed_writer_add (const char* key, size_t key_len, const char* data, size_t data_len)
+{
+  writer->entries = realloc (writer->entries, (writer->n_entries+1) * sizeof (struct PackedEntry));
+  struct PackedEntry* entry = &writer->entries[writer->n_entries++];
+  entry->hash = tdpkg_hash (key, key_len);
+  entry->key_len = key_len;
+  entry->key_offset = writer->offset;
+  entry->data_offset = writer->offset + key_len + 1;
+  entry->data_len = data_len;
+
+  if (fwrite (key, sizeof (char), key_len, writer->file) < key_len
+      || fputc ('\0', writer->file) == EOF
+      || fwrite (data, sizeof (char), data_len, writer->file) < data_len
+      || fputc ('\0', writer->file) == EOF)
+    {
+      fprintf (stderr, "tdpkg packed: can't write %s: %s\n", cache_tmp_file, strerror (errno));
+      return -1;
+    }
+  writer->offset += key_len + data_len + 2;
+  return 0;
+}
+
+static void
+_packed_writer_change (const char* key, int entry)
+{
+  writer->changes = realloc (writer->changes, (writer->n_changes+1) * sizeof (struct PackedChange));
+  struct PackedChange* change = &writer->changes[writer->n_changes++];
+  change->key = strdup (key);
+  change->hash = tdpkg_hash (key, strlen (key));
+  change->entry = entry;
+}
+
+static void
+_packed_writer_free (void)
+{
+  uint32_t i;
+  for (i=0; i < writer->n_changes; i++)
+    free (writer->changes[i].key);
+  free (writer->changes);
+  free (writer->entries);
+  free (writer);
+  writer = NULL;
+}
+
+/* index of the last change of each key, keyed by hash */
+static uint32_t*
+_packed_changes_index (uint32_t n_buckets)
+{
+  uint32_t* index = malloc (n_buckets * sizeof (uint32_t));
+  memset (index, 0xff, n_buckets * sizeof (uint32_t));
+  uint32_t mask = n_buckets-1;
+  uint32_t i;
+  for (i=0; i < writer->n_changes; i++)
+    {
+      struct PackedChange* change = &writer->changes[i];
+      uint32_t b;
+      for (b = change->hash & mask; index[b] != PACKED_EMPTY; b = (b+1) & mask)
+        if (!strcmp (writer->changes[index[b]].key, change->key))
+          break;
+      index[b] = i;
+    }
+  return index;
+}
+
+static const struct PackedChange*
+_packed_changes_lookup (const uint32_t* index, uint32_t n_buckets, const char* key, uint32_t hash)
+{
+  uint32_t mask = n_buckets-1;
+  uint32_t b;
+  for (b = hash & mask; index[b] != PACKED_EMPTY; b = (b+1) & mask)
+    if (!strcmp (writer->changes[index[b]].key, key))
+      return &writer->changes[index[b]];
+  return NULL;
+}
+
+static void _packed_abort (void);
+
+static int
+_packed_initialize (void)
+{
+  if (!cache_file)
+    {
+      cache_file = tdpkg_backend_file ("packed");
+      cache_tmp_file = malloc (strlen (cache_file) + 5);
+      sprintf (cache_tmp_file, "%s.tmp", cache_file);
+    }
+  return 0;
+}
+
+static int
+_packed_open (int write)
+{
+  if (opened)
+    return 0;
+  opened = 1;
+
+  /* missing or invalid caches are replaced on the first write */
+  _packed_map ();
+  return 0;
+}
+
+static void
+_packed_close (void)
+{
+  if (writer)
+    _packed_abort ();
+  _packed_unmap ();
+  opened = 0;
+}
+
+static int
+_packed_open_fd (int fd)
+{
+  if (opened)
+    _packed_close ();
+
+  int result = _packed_map_fd (fd);
+  close (fd);
+  opened = !result;
+  return result;
+}
+
+static const char*
+_packed_get (const char* key, size_t* len)
+{
+  const struct PackedEntry* entry = _packed_lookup (key);
+  if (!entry)
+    return NULL;
+
+  n_borrowed++;
+  *len = entry->data_len;
+  return map + entry->data_offset;
+}
+
+static void
+_packed_release (const char* value)
+{
+  if (n_borrowed > 0 && !--n_borrowed)
+    _packed_unmap_retired ();
+}
+
+static int
+_packed_begin_batch (int keep)
+{
+  if (writer)
+    return -1;
+
+  /* another process may have replaced the cache since it was mapped */
+  _packed_unmap ();
+  _packed_map ();
+
+  writer = calloc (1, sizeof (struct PackedWriter));
+  writer->keep = keep;
+  writer->file = fopen (cache_tmp_file, "w");
+  if (!writer->file)
+    {
+      fprintf (stderr, "tdpkg packed: can't create %s: %s\n", cache_tmp_file, strerror (errno));
+      _packed_writer_free ();
+      return -1;
+    }
+
+  /* values are streamed right away, the header is written on commit */
+  writer->offset = sizeof (struct PackedHeader);
+  if (fseek (writer->file, writer->offset, SEEK_SET))
+    {
+      fprintf (stderr, "tdpkg packed: can't seek %s: %s\n", cache_tmp_file, strerror (errno));
+      _packed_abort ();
+      return -1;
+    }
+  return 0;
+}
+
+static int
+_packed_begin (void)
+{
+  return _packed_begin_batch (1);
+}
+
+static int
+_packed_begin_ordered (void)
+{
+  return _packed_begin_batch (0);
+}
+
+static void
+_packed_abort (void)
+{
+  if (!writer)
+    return;
+  fclose (writer->file);
+  unlink (cache_tmp_file);
+  _packed_writer_free ();
+}
+
+static int
+_packed_commit (void)
+{
+  if (!writer)
+    return -1;
+
+  uint32_t n_changes_buckets = _packed_n_buckets (writer->n_changes);
+  uint32_t* changes_index = _packed_changes_index (n_changes_buckets);
+
+  /* copy what's left of the current cache after the changed entries */
+  uint32_t n_changed = writer->n_entries;
+  uint32_t i;
+  for (i=0; map && writer->keep && i < header->n_entries; i++)
+    {
+      const struct PackedEntry* entry = &entries[i];
+      if (!_packed_entry_valid (entry))
+        {
+          fprintf (stderr, "tdpkg packed: %s is corrupted\n", cache_file);
+          free (changes_index);
+          _packed_abort ();
+          return -1;
+        }
+      const char* key = map + entry->key_offset;
+      if (_packed_changes_lookup (changes_index, n_changes_buckets, key, entry->hash))
+        continue;
+      if (_packed_writer_add (key, entry->key_len, map + entry->data_offset, entry->data_len))
+        {
+          free (changes_index);
+          _packed_abort ();
+          return -1;
+        }
+    }
+
+  /* only the last put of each key is indexed, deleted keys are not */
+  struct PackedEntry* indexed = malloc ((writer->n_entries ? writer->n_entries : 1) * sizeof (struct PackedEntry));
+  uint32_t n_indexed = 0;
+  for (i=0; i < writer->n_changes; i++)
+    {
+      struct PackedChange* change = &writer->changes[i];
+      if (change->entry >= 0
+          && _packed_changes_lookup (changes_index, n_changes_buckets, change->key, change->hash) == change)
+        indexed[n_indexed++] = writer->entries[change->entry];
+    }
+  for (i=n_changed; i < writer->n_entries; i++)
+    indexed[n_indexed++] = writer->entries[i];
+  free (changes_index);
+
+  struct PackedHeader h;
+  memcpy (h.magic, PACKED_MAGIC, sizeof (h.magic));
+  h.n_buckets = _packed_n_buckets (n_indexed);
+  h.n_entries = n_indexed;
+  h.tables_offset = (writer->offset + 7) & ~(uint64_t)7;
+  h.size = h.tables_offset + h.n_buckets * sizeof (uint32_t) + h.n_entries * sizeof (struct PackedEntry);
+
+  uint32_t* new_buckets = malloc (h.n_buckets * sizeof (uint32_t));
+  memset (new_buckets, 0xff, h.n_buckets * sizeof (uint32_t));
+  uint32_t mask = h.n_buckets-1;
+  for (i=0; i < n_indexed; i++)
+    {
+      uint32_t b = indexed[i].hash & mask;
+      while (new_buckets[b] != PACKED_EMPTY)
+        b = (b+1) & mask;
+      new_buckets[b] = i;
+    }
+
+  static const char padding[8];
+  int failed = fwrite (padding, 1, h.tables_offset - writer->offset, writer->file) < h.tables_offset - writer->offset
+    || fwrite (new_buckets, sizeof (uint32_t), h.n_buckets, writer->file) < h.n_buckets
+    || fwrite (indexed, sizeof (struct PackedEntry), h.n_entries, writer->file) < h.n_entries
+    || fseek (writer->file, 0, SEEK_SET)
+    || fwrite (&h, sizeof (h), 1, writer->file) < 1
+    || fflush (writer->file)
+    || fsync (fileno (writer->file));
+  free (new_buckets);
+  free (indexed);
+  if (failed)
+    {
+      fprintf (stderr, "tdpkg packed: can't write %s: %s\n", cache_tmp_file, strerror (errno));
+      _packed_abort ();
+      return -1;
+    }
+  fclose (writer->file);
+  _packed_writer_free ();
+
+  if (rename (cache_tmp_file, cache_file))
+    {
+      fprintf (stderr, "tdpkg packed: can't rename %s: %s\n", cache_tmp_file, strerror (errno));
+      unlink (cache_tmp_file);
+      return -1;
+    }
+
+  _packed_unmap ();
+  return _packed_map ();
+}
+
+static int
+_packed_put (const char* key, const char* value, size_t len)
+{
+  if (!writer)
+    {
+      if (_packed_begin () || _packed_put (key, value, len))
+        {
+          _packed_abort ();
+          return -1;
+        }
+      return _packed_commit ();
+    }
+
+  int entry = writer->n_entries;
+  if (_packed_writer_add (key, strlen (key), value, len))
+    return -1;
+  _packed_writer_change (key, entry);
+  return 0;
+}
+
+static int
+_packed_delete (const char* key)
+{
+  if (!writer)
+    {
+      if (!_packed_lookup (key))
+        return 0;
+      if (_packed_begin () || _packed_delete (key))
+        {
+          _packed_abort ();
+          return -1;
+        }
+      return _packed_commit ();
+    }
+
+  _packed_writer_change (key, -1);
+  return 0;
+}
+
+static int
+_packed_foreach (size_t prefix, TdpkgBackendFunc func, void* data)
+{
+  uint32_t i;
+  for (i=0; map && i < header->n_entries; i++)
+    {
+      const struct PackedEntry* entry = &entries[i];
+      if (!_packed_entry_valid (entry))
+        return -1;
+      if (func (map + entry->key_offset, map + entry->data_offset, entry->data_len, data))
+        return 0;
+    }
+  return 0;
+}
+
+const TdpkgBackend tdpkg_backend_packed =
+{
+  "packed",
+  _packed_initialize,
+  _packed_open,
+  _packed_open_fd,
+  _packed_close,
+  _packed_get,
+  _packed_release,
+  _packed_put,
+  _packed_delete,
+  _packed_begin,
+  _packed_begin_ordered,
+  _packed_commit,
+  _packed_abort,
+  _packed_foreach
+};
@@ -22,26 +22,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sqlite3.h>
-#include <glob.h>
-#include <sys/stat.h>
-#include <errno.h>
 
-#include "cache.h"
-#include "util.h"
-
-#define CACHE_FILE "/var/lib/dpkg/info/tdpkg.cache"
+#include "backend.h"
 
 #define sqlite_error(ret) { fprintf (stderr, "tdpkg sqlite: %s\n", sqlite3_errmsg (db)); return ret; }
-#define CREATE_TABLE_SQL "CREATE TABLE IF NOT EXISTS files (filename varchar(255) PRIMARY KEY ON CONFLICT REPLACE, contents text);"
+#define CREATE_TABLE_SQL "CREATE TABLE IF NOT EXISTS files (filename varchar(255) PRIMARY KEY ON CONFLICT REPLACE, contents blob);"
 #define READ_FILE_SQL "SELECT contents FROM files WHERE filename=?"
 #define INSERT_FILE_SQL "INSERT INTO files (filename, contents) VALUES (?, ?)"
 #define DELETE_FILE_SQL "DELETE FROM files WHERE filename=?"
+#define LIST_FILES_SQL "SELECT filename, contents, length(contents) FROM files"
+#define LIST_PREFIXES_SQL "SELECT filename, substr(contents, 1, ?), length(contents) FROM files"
 
+static char* cache_file = NULL;
 static sqlite3* db = NULL;
 static sqlite3_stmt* read_file_stmt = NULL;
 static sqlite3_stmt* insert_file_stmt = NULL;
 static sqlite3_stmt* delete_file_stmt = NULL;
 
+static void _sqlite_close (void);
+
 static int
 _sqlite_exec (const char* sql)
 {
@@ -56,42 +55,62 @@ _sqlite_exec (const char* sql)
   return 0;
 }
 
+/* with the write-ahead log readers don't wait for the writer, and keep
+   reading what was committed when their query started. The log is kept
+   around so that users who can't write the cache can still read it */
+static int
+_sqlite_connect (void)
+{
+  if (sqlite3_open (cache_file, &db) != SQLITE_OK)
+    return -1;
+
+  sqlite3_busy_timeout (db, 10000);
+  int persist = 1;
+  sqlite3_file_control (db, "main", SQLITE_FCNTL_PERSIST_WAL, &persist);
+  sqlite3_exec (db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
+  return 0;
+}
+
 /* returns 0 on success */
-int
-tdpkg_cache_initialize (void)
+static int
+_sqlite_initialize (void)
 {
   if (sqlite3_initialize () != SQLITE_OK)
     sqlite_error (-1);
+  if (!cache_file)
+    cache_file = tdpkg_backend_file ("sqlite");
 
   return 0;
 }
 
 static int
-_sqlite_init (void)
+_sqlite_open (int write)
 {
   if (db)
     return 0;
 
-  if (sqlite3_open (CACHE_FILE, &db) != SQLITE_OK)
+  if (_sqlite_connect ())
     {
-      if (unlink (CACHE_FILE))
+      if (unlink (cache_file))
         {
-          tdpkg_cache_finalize ();
+          _sqlite_close ();
           return -1;
         }
-      if (sqlite3_open (CACHE_FILE, &db) != SQLITE_OK)
+      if (_sqlite_connect ())
         {
-          tdpkg_cache_finalize ();
+          _sqlite_close ();
           sqlite_error (-1);
         }
     }
 
   if (_sqlite_exec (CREATE_TABLE_SQL))
     {
-      tdpkg_cache_finalize ();
-      if (unlink (CACHE_FILE))
+      /* only a corrupted cache is replaced, not one being written */
+      int code = sqlite3_errcode (db);
+      _sqlite_close ();
+      if ((code != SQLITE_NOTADB && code != SQLITE_CORRUPT) || unlink (cache_file))
         return -1;
-      if (sqlite3_open (CACHE_FILE, &db) != SQLITE_OK)
+      if (_sqlite_connect ())
         sqlite_error (-1);
       if (_sqlite_exec (CREATE_TABLE_SQL))
         return -1;
@@ -99,103 +118,59 @@ _sqlite_init (void)
 
   if (sqlite3_prepare (db, READ_FILE_SQL, -1, &read_file_stmt, NULL) != SQLITE_OK)
     {
-      tdpkg_cache_finalize ();
+      _sqlite_close ();
       sqlite_error (-1);
     }
 
   if (sqlite3_prepare (db, INSERT_FILE_SQL, -1, &insert_file_stmt, NULL) != SQLITE_OK)
     {
-      tdpkg_cache_finalize ();
+      _sqlite_close ();
       sqlite_error (-1);
     }
 
   if (sqlite3_prepare (db, DELETE_FILE_SQL, -1, &delete_file_stmt, NULL) != SQLITE_OK)
     {
-      tdpkg_cache_finalize ();
+      _sqlite_close ();
       sqlite_error (-1);
     }
 
-  /* ensure cache consistency with the file system */
-  struct stat stat_buf;
-  if (tdpkg_stat (CACHE_FILE, &stat_buf))
-    {
-      if (tdpkg_cache_rebuild ())
-        {
-          tdpkg_cache_finalize ();
-          return -1;
-        }
-      return 0;
-    }
-  time_t db_time = stat_buf.st_mtime;
-
-  glob_t glob_list;
-  if (glob ("/var/lib/dpkg/info/*.list", 0, NULL, &glob_list))
-    {
-      fprintf (stderr, "tdpkg sqlite: can't glob /var/lib/dpkg/info/*.list\n");
-      tdpkg_cache_finalize ();
-      return -1;
-    }
-
-  int i;
-  for (i=0; i < glob_list.gl_pathc; i++)
-    {
-      const char* filename = glob_list.gl_pathv[i];
-      struct stat stat_buf;
-
-      /* we don't use fstat because it's been wrapped */
-      if (tdpkg_stat (filename, &stat_buf))
-        {
-          fprintf (stderr, "tdpkg sqlite: can't stat %s: %s\n", filename, strerror (errno));
-          tdpkg_cache_finalize ();
-          return -1;
-        }
-
-      /* list file more recent than cache */
-      if (stat_buf.st_mtime > db_time)
-        {
-          if (tdpkg_cache_rebuild ())
-            {
-              globfree (&glob_list);
-              tdpkg_cache_finalize ();
-              return -1;
-            }
-          break;
-        }
-    }
-  globfree (&glob_list);
-
   return 0;
 }
 
-void
-tdpkg_cache_finalize (void)
+static void
+_sqlite_close (void)
 {
   if (read_file_stmt)
     sqlite3_finalize (read_file_stmt);
   if (insert_file_stmt)
     sqlite3_finalize (insert_file_stmt);
+  if (delete_file_stmt)
+    sqlite3_finalize (delete_file_stmt);
   if (db)
     sqlite3_close (db);
   sqlite3_shutdown ();
+  read_file_stmt = NULL;
+  insert_file_stmt = NULL;
+  delete_file_stmt = NULL;
   db = NULL;
 }
 
-char*
-tdpkg_cache_read_filename (const char* filename)
+static const char*
+_sqlite_get (const char* key, size_t* len)
 {
-  if (_sqlite_init ())
-    return NULL;
-
   if (sqlite3_reset (read_file_stmt) != SQLITE_OK)
     sqlite_error (NULL);
 
-  if (sqlite3_bind_text (read_file_stmt, 1, filename, -1, SQLITE_STATIC) != SQLITE_OK)
+  if (sqlite3_bind_text (read_file_stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK)
     sqlite_error (NULL);
 
   if (sqlite3_step (read_file_stmt) != SQLITE_ROW)
     return NULL;
 
-  char* result = strdup ((const char*)sqlite3_column_text (read_file_stmt, 0));
+  /* the statement is reused by the next lookup, so keep a copy */
+  int size = sqlite3_column_bytes (read_file_stmt, 0);
+  char* result = malloc (size ? size : 1);
+  memcpy (result, sqlite3_column_blob (read_file_stmt, 0), size);
 
   if (sqlite3_step (read_file_stmt) != SQLITE_DONE)
     {
@@ -203,72 +178,41 @@ tdpkg_cache_read_filename (const char* filename)
       sqlite_error (NULL);
     }
 
+  *len = size;
   return result;
 }
 
-int
-tdpkg_cache_write_filename (const char* filename)
+static void
+_sqlite_release (const char* value)
 {
-  if (_sqlite_init ())
-    return -1;
-
-  struct stat stat_buf;
-  if (tdpkg_stat (filename, &stat_buf))
-    {
-      fprintf (stderr, "tdpkg sqlite: can't stat %s: %s\n", filename, strerror (errno));
-      return -1;
-    }
-  size_t size = stat_buf.st_size;
-
-  FILE* file = fopen (filename, "r");
-  if (!file)
-    {
-      fprintf (stderr, "tdpkg sqlite: can't open %s: %s\n", filename, strerror (errno));
-      return -1;
-    }
-
-  char* contents = malloc (size);
-  if (fread (contents, sizeof (char), size, file) < size)
-    {
-      // FIXME: let's handle this?
-      fprintf (stderr, "tdpkg sqlite: can't read full file %s of size %u\n", filename, size);
-      fclose (file);
-      return -1;
-    }
-  fclose (file);
+  free ((void*)value);
+}
 
+static int
+_sqlite_put (const char* key, const char* value, size_t len)
+{
   if (sqlite3_reset (insert_file_stmt) != SQLITE_OK)
     sqlite_error (-1);
 
-  if (sqlite3_bind_text (insert_file_stmt, 1, filename, -1, SQLITE_STATIC) != SQLITE_OK)
+  if (sqlite3_bind_text (insert_file_stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK)
     sqlite_error (-1);
 
-  if (sqlite3_bind_text (insert_file_stmt, 2, contents, size, SQLITE_STATIC) != SQLITE_OK)
-    {
-      free (contents);
-      sqlite_error (-1);
-    }
+  if (sqlite3_bind_blob (insert_file_stmt, 2, value, len, SQLITE_STATIC) != SQLITE_OK)
+    sqlite_error (-1);
 
   if (sqlite3_step (insert_file_stmt) != SQLITE_DONE)
-    {
-      free (contents);
-      sqlite_error (-1);
-    }
+    sqlite_error (-1);
 
-  free (contents);
   return 0;
 }
 
-int
-tdpkg_cache_delete_filename (const char* filename)
+static int
+_sqlite_delete (const char* key)
 {
-  if (_sqlite_init ())
-    return -1;
-
   if (sqlite3_reset (delete_file_stmt) != SQLITE_OK)
     sqlite_error (-1);
 
-  if (sqlite3_bind_text (delete_file_stmt, 1, filename, -1, SQLITE_STATIC) != SQLITE_OK)
+  if (sqlite3_bind_text (delete_file_stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK)
     sqlite_error (-1);
 
   if (sqlite3_step (delete_file_stmt) != SQLITE_DONE)
@@ -276,44 +220,70 @@ tdpkg_cache_delete_filename (const char* filename)
 
   return 0;
 }
-  
 
-int
-tdpkg_cache_rebuild (void)
+static int
+_sqlite_begin (void)
 {
-  if (_sqlite_init ())
-    return -1;
+  return _sqlite_exec ("BEGIN;");
+}
 
-  glob_t glob_list;
-  if (glob ("/var/lib/dpkg/info/*.list", 0, NULL, &glob_list))
-    {
-      fprintf (stderr, "tdpkg sqlite: can't glob /var/lib/dpkg/info/*.list\n");
-      return -1;
-    }
+static int
+_sqlite_commit (void)
+{
+  return _sqlite_exec ("COMMIT;");
+}
 
-  if (_sqlite_exec ("DELETE FROM files; BEGIN;"))
+static void
+_sqlite_abort (void)
+{
+  _sqlite_exec ("ROLLBACK;");
+}
+
+static int
+_sqlite_foreach (size_t prefix, TdpkgBackendFunc func, void* data)
+{
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare (db, prefix ? LIST_PREFIXES_SQL : LIST_FILES_SQL, -1, &stmt, NULL) != SQLITE_OK)
+    sqlite_error (-1);
+
+  if (prefix && sqlite3_bind_int64 (stmt, 1, prefix) != SQLITE_OK)
     {
-      globfree (&glob_list);
-      return -1;
+      sqlite3_finalize (stmt);
+      sqlite_error (-1);
     }
 
-  int i;
-  for (i=0; i < glob_list.gl_pathc; i++)
+  int result;
+  while ((result = sqlite3_step (stmt)) == SQLITE_ROW)
     {
-      const char* filename = glob_list.gl_pathv[i];
-      printf ("tdpkg: (Indexing list file %d...)\r", i+1);
-      if (tdpkg_cache_write_filename (filename))
+      const char* key = (const char*)sqlite3_column_text (stmt, 0);
+      const char* value = sqlite3_column_blob (stmt, 1);
+      if (func (key, value, sqlite3_column_int64 (stmt, 2), data))
         {
-          _sqlite_exec ("ROLLBACK;");
-          globfree (&glob_list);
-          return -1;
+          result = SQLITE_DONE;
+          break;
         }
     }
-  globfree (&glob_list);
+  sqlite3_finalize (stmt);
 
-  if (_sqlite_exec ("COMMIT;"))
-    return -1;
-
-  printf ("tdpkg: %d list files cached succefully\n", i);
+  if (result != SQLITE_DONE)
+    sqlite_error (-1);
   return 0;
 }
+
+const TdpkgBackend tdpkg_backend_sqlite =
+{
+  "sqlite",
+  _sqlite_initialize,
+  _sqlite_open,
+  NULL,
+  _sqlite_close,
+  _sqlite_get,
+  _sqlite_release,
+  _sqlite_put,
+  _sqlite_delete,
+  _sqlite_begin,
+  NULL,
+  _sqlite_commit,
+  _sqlite_abort,
+  _sqlite_foreach
+};
@@ -21,231 +21,327 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <glob.h>
-#include <sys/stat.h>
 #include <errno.h>
 
 #include <tchdb.h>
 
-#include "cache.h"
-#include "util.h"
-
-#define CACHE_FILE "/var/lib/dpkg/info/tdpkg.cache"
+#include "backend.h"
 
+/* Batches are written in place in a transaction of tokyocabinet, writers
+   take turns on tdpkg.lock. Only an ordered batch, which rewrites every
+   record anyway, is written to a new file renamed into place on commit.
+   Readers don't lock the database. */
+static char* cache_file = NULL;
+static char* cache_tmp_file = NULL;
 static TCHDB* db = NULL;
-static int in_transaction = 0;
-static int is_write = 0;
+static TCHDB* writer = NULL;
+/* the batch is a transaction on db, which writer is then */
+static int in_place = 0;
+static int opened = 0;
+
+#define tc_error(hdb, ret) { fprintf (stderr, "tdpkg tokio: %s\n", tchdberrmsg (tchdbecode (hdb))); return ret; }
 
-#define tc_error(ret) { fprintf (stderr, "tdpkg tokio: %s\n", tchdberrmsg (tchdbecode (db))); return ret; }
+static int _tokyo_begin (void);
+static int _tokyo_begin_ordered (void);
+static int _tokyo_commit (void);
+static void _tokyo_abort (void);
 
 static int
-_tokyo_init (int write)
+_tokyo_initialize (void)
 {
-  if (db && is_write >= write)
-    return 0;
-
-  if (db)
-    tdpkg_cache_finalize ();
+  if (!cache_file)
+    {
+      cache_file = tdpkg_backend_file ("tokyo");
+      cache_tmp_file = malloc (strlen (cache_file) + 5);
+      sprintf (cache_tmp_file, "%s.tmp", cache_file);
+    }
+  return 0;
+}
 
+/* a missing or invalid cache is left closed, it's replaced on commit */
+static int
+_tokyo_open_file (void)
+{
   db = tchdbnew ();
-  int flags = HDBOREADER | HDBOLCKNB;
-  if (write)
-    flags |= HDBOWRITER | HDBOCREAT;
+  if (tchdbopen (db, cache_file, HDBOREADER | HDBOLCKNB))
+    return 0;
 
-  if (!tchdbopen (db, CACHE_FILE, flags))
+  int ecode = tchdbecode (db);
+  tchdbdel (db);
+  db = NULL;
+  if (ecode != TCENOFILE && ecode != TCEMETA && ecode != TCEREAD)
     {
-      int ecode = tchdbecode (db);
-      if (ecode == TCEMETA || ecode == TCEREAD)
-        {
-          tchdbdel (db);
-          db = NULL;
-          if (unlink (CACHE_FILE))
-            return -1;
-          db = tchdbnew ();
-          if (!tchdbopen (db, CACHE_FILE, flags))
-            {
-              if (tchdbecode (db) != TCENOFILE)
-                tc_error (-1);
-            }
-        }
-      else if (ecode != TCENOFILE)
-        tc_error (-1);
+      fprintf (stderr, "tdpkg tokio: %s\n", tchdberrmsg (ecode));
+      return -1;
     }
-  if (write && !tchdbsync (db))
-    tc_error (-1);
+  return 0;
+}
 
-  /* ensure cache consistency with the file system */
-  struct stat stat_buf;
-  if (tdpkg_stat (CACHE_FILE, &stat_buf))
+static void
+_tokyo_close_file (void)
+{
+  if (db)
     {
-      if (tdpkg_cache_rebuild ())
+      tchdbclose (db);
+      tchdbdel (db);
+    }
+  db = NULL;
+}
+
+static int
+_tokyo_open (int write)
+{
+  if (opened)
+    return 0;
+  if (_tokyo_open_file ())
+    return -1;
+  opened = 1;
+  return 0;
+}
+
+static void
+_tokyo_close (void)
+{
+  if (writer)
+    _tokyo_abort ();
+  _tokyo_close_file ();
+  opened = 0;
+}
+
+static const char*
+_tokyo_get (const char* key, size_t* len)
+{
+  if (!db)
+    return NULL;
+
+  int size;
+  char* value = tchdbget (db, key, strlen (key), &size);
+  if (!value)
+    return NULL;
+
+  *len = size;
+  return value;
+}
+
+static void
+_tokyo_release (const char* value)
+{
+  tcfree ((void*)value);
+}
+
+static int
+_tokyo_put (const char* key, const char* value, size_t len)
+{
+  if (!writer)
+    {
+      if (_tokyo_begin () || _tokyo_put (key, value, len))
         {
-          tdpkg_cache_finalize ();
+          _tokyo_abort ();
           return -1;
         }
-      return 0;
+      return _tokyo_commit ();
     }
-  time_t db_time = stat_buf.st_mtime;
 
-  glob_t glob_list;
-  if (glob ("/var/lib/dpkg/info/*.list", 0, NULL, &glob_list))
+  /* async puts are only delayed to the commit of a new file */
+  if (in_place)
     {
-      fprintf (stderr, "tdpkg sqlite: can't glob /var/lib/dpkg/info/*.list\n");
-      tdpkg_cache_finalize ();
-      return -1;
+      if (!tchdbput (writer, key, strlen (key), value, len))
+        tc_error (writer, -1);
     }
+  else if (!tchdbputasync (writer, key, strlen (key), value, len))
+    tc_error (writer, -1);
+  return 0;
+}
 
-  int i;
-  for (i=0; i < glob_list.gl_pathc; i++)
+static int
+_tokyo_delete (const char* key)
+{
+  if (!writer)
     {
-      const char* filename = glob_list.gl_pathv[i];
-      struct stat stat_buf;
-
-      /* we don't use fstat because it's been wrapped */
-      if (tdpkg_stat (filename, &stat_buf))
+      if (!db || tchdbvsiz (db, key, strlen (key)) < 0)
+        return 0;
+      if (_tokyo_begin () || _tokyo_delete (key))
         {
-          fprintf (stderr, "tdpkg sqlite: can't stat %s: %s\n", filename, strerror (errno));
-          tdpkg_cache_finalize ();
+          _tokyo_abort ();
           return -1;
         }
-
-      /* list file more recent than cache */
-      if (stat_buf.st_mtime > db_time)
-        {
-          if (tdpkg_cache_rebuild ())
-            {
-              globfree (&glob_list);
-              tdpkg_cache_finalize ();
-              return -1;
-            }
-          break;
-        }
+      return _tokyo_commit ();
     }
-  globfree (&glob_list);
 
-  is_write = write;
+  if (!tchdbout (writer, key, strlen (key)) && tchdbecode (writer) != TCENOREC)
+    tc_error (writer, -1);
   return 0;
 }
 
-
-int
-tdpkg_cache_initialize (void)
+/* the cache is opened again for writing, the lock being held. A missing
+   or invalid one is written anew */
+static int
+_tokyo_begin (void)
 {
-  return 0;
-}
+  if (writer)
+    return -1;
 
-void
-tdpkg_cache_finalize (void)
-{
-  if (db && !tchdbclose (db))
+  _tokyo_close_file ();
+  if (_tokyo_open_file ())
+    return -1;
+  if (!db)
+    return _tokyo_begin_ordered ();
+
+  _tokyo_close_file ();
+  db = tchdbnew ();
+  if (!tchdbopen (db, cache_file, HDBOWRITER | HDBOCREAT | HDBOLCKNB) || !tchdbtranbegin (db))
     {
-      if (tchdbecode (db) != TCENOFILE)
-        tc_error ();
+      fprintf (stderr, "tdpkg tokio: %s\n", tchdberrmsg (tchdbecode (db)));
+      _tokyo_close_file ();
+      _tokyo_open_file ();
+      return -1;
     }
-  if (db)
-    tchdbdel (db);
-  db = NULL;
+  writer = db;
+  in_place = 1;
+  return 0;
 }
 
-char*
-tdpkg_cache_read_filename (const char* filename)
+/* an empty database stores records in the order they're put */
+static int
+_tokyo_begin_ordered (void)
 {
-  if (_tokyo_init (0))
-    return NULL;
+  if (writer)
+    return -1;
+
+  /* another process may have replaced the cache since it was opened */
+  _tokyo_close_file ();
+  if (_tokyo_open_file ())
+    return -1;
 
-  return tchdbget2 (db, filename);
+  unlink (cache_tmp_file);
+  writer = tchdbnew ();
+  if (!tchdbopen (writer, cache_tmp_file, HDBOWRITER | HDBOCREAT | HDBOLCKNB))
+    {
+      fprintf (stderr, "tdpkg tokio: %s\n", tchdberrmsg (tchdbecode (writer)));
+      tchdbdel (writer);
+      writer = NULL;
+      unlink (cache_tmp_file);
+      return -1;
+    }
+  return 0;
 }
 
-int
-tdpkg_cache_write_filename (const char* filename)
+static int
+_tokyo_commit (void)
 {
-  if (_tokyo_init (1))
+  if (!writer)
     return -1;
 
-  struct stat stat_buf;
-  if (tdpkg_stat (filename, &stat_buf))
+  if (in_place)
     {
-      fprintf (stderr, "tdpkg tokyo: can't stat %s: %s\n", filename, strerror (errno));
-      return -1;
+      int failed = !tchdbtrancommit (db);
+      if (failed)
+        fprintf (stderr, "tdpkg tokio: %s\n", tchdberrmsg (tchdbecode (db)));
+      writer = NULL;
+      in_place = 0;
+      _tokyo_close_file ();
+      if (_tokyo_open_file ())
+        failed = 1;
+      return failed ? -1 : 0;
     }
-  size_t size = stat_buf.st_size;
 
-  FILE* file = fopen (filename, "r");
-  if (!file)
+  int failed = !tchdbsync (writer);
+  if (failed)
+    fprintf (stderr, "tdpkg tokio: %s\n", tchdberrmsg (tchdbecode (writer)));
+  if (!tchdbclose (writer) && !failed)
     {
-      fprintf (stderr, "tdpkg tokyo: can't open %s\n", filename);
-      return -1;
+      fprintf (stderr, "tdpkg tokio: %s\n", tchdberrmsg (tchdbecode (writer)));
+      failed = 1;
     }
-
-  char* contents = malloc (size+1);
-  if (fread (contents, sizeof (char), size, file) < size)
+  tchdbdel (writer);
+  writer = NULL;
+  if (failed)
     {
-      // FIXME: let's handle this?
-      fprintf (stderr, "tdpkg tokyo: can't read full file %s of size %u\n", filename, size);
-      fclose (file);
+      unlink (cache_tmp_file);
       return -1;
     }
-  fclose (file);
-  contents[size] = '\0';
 
-  if (!tchdbputasync2 (db, filename, contents))
+  if (rename (cache_tmp_file, cache_file))
     {
-      free (contents);
-      tc_error (-1);
+      fprintf (stderr, "tdpkg tokio: can't rename %s: %s\n", cache_tmp_file, strerror (errno));
+      unlink (cache_tmp_file);
+      return -1;
     }
-  free (contents);
 
-  if (!in_transaction && !tchdbsync (db))
-    tc_error (-1);
-  return 0;
+  _tokyo_close_file ();
+  return _tokyo_open_file ();
 }
 
-int
-tdpkg_cache_delete_filename (const char* filename)
+static void
+_tokyo_abort (void)
 {
-  if (!tchdbout2 (db, filename))
-    tc_error (-1);
-  if (!tchdbsync (db))
-    tc_error (-1);
-  return 0;
-}
-
-int
-tdpkg_cache_rebuild (void)
-{
-  if (_tokyo_init (1))
-    return -1;
-
-  glob_t glob_list;
-  if (glob ("/var/lib/dpkg/info/*.list", 0, NULL, &glob_list))
+  if (!writer)
+    return;
+  if (in_place)
     {
-      fprintf (stderr, "tdpkg sqlite: can't glob /var/lib/dpkg/info/*.list\n");
-      return -1;
+      tchdbtranabort (db);
+      writer = NULL;
+      in_place = 0;
+      _tokyo_close_file ();
+      _tokyo_open_file ();
+      return;
     }
+  tchdbclose (writer);
+  tchdbdel (writer);
+  writer = NULL;
+  unlink (cache_tmp_file);
+}
 
-  if (!tchdbvanish (db))
-    tc_error (-1);
+static int
+_tokyo_foreach (size_t prefix, TdpkgBackendFunc func, void* data)
+{
+  if (!db)
+    return 0;
+  if (!tchdbiterinit (db))
+    tc_error (db, -1);
 
-  in_transaction = 1;
-  int i;
-  for (i=0; i < glob_list.gl_pathc; i++)
+  char* buf = prefix ? malloc (prefix) : NULL;
+  int key_size;
+  char* key;
+  while ((key = tchdbiternext (db, &key_size)))
     {
-      const char* filename = glob_list.gl_pathv[i];
-      printf ("tdpkg: (Indexing list file %d...)\r", i+1);
-      if (tdpkg_cache_write_filename (filename))
+      int stop = 0;
+      if (prefix)
         {
-          globfree (&glob_list);
-          in_transaction = 0;
-          tchdbvanish (db);
-          return -1;
+          /* tchdbget3 only copies the first prefix bytes */
+          int size = tchdbvsiz (db, key, key_size);
+          if (size >= 0 && tchdbget3 (db, key, key_size, buf, prefix) >= 0)
+            stop = func (key, buf, size, data);
         }
+      else
+        {
+          int size;
+          char* value = tchdbget (db, key, key_size, &size);
+          stop = value && func (key, value, size, data);
+          tcfree (value);
+        }
+      tcfree (key);
+      if (stop)
+        break;
     }
-  globfree (&glob_list);
-  in_transaction = 0;
-
-  if (!tchdbsync (db))
-    tc_error (-1);
-
-  printf ("tdpkg: %d list files cached succefully\n", i);
+  free (buf);
   return 0;
 }
+
+const TdpkgBackend tdpkg_backend_tokyo =
+{
+  "tokyo",
+  _tokyo_initialize,
+  _tokyo_open,
+  NULL,
+  _tokyo_close,
+  _tokyo_get,
+  _tokyo_release,
+  _tokyo_put,
+  _tokyo_delete,
+  _tokyo_begin,
+  _tokyo_begin_ordered,
+  _tokyo_commit,
+  _tokyo_abort,
+  _tokyo_foreach
+};
@@ -0,0 +1,1301 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+#include "cache.h"
+#include "backend.h"
+#include "loader.h"
+#include "blocks.h"
+#include "paths.h"
+#include "owners.h"
+#include "arena.h"
+#include "journal.h"
+#include "layout.h"
+#include "server.h"
+#include "util.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Every value starts with the stat of the list file it was read from.
+   The stamp key holds the stat of the info directory taken when the
+   cache was last known to be in sync: as long as the directory didn't
+   change no list file did, otherwise each entry is checked when read. */
+#define ENTRY_MAGIC 0x31455444 /* TDE1 */
+/* the contents are block-compressed, see blocks.h */
+#define ENTRY_MAGIC_BLOCKS 0x315a4454 /* TDZ1 */
+/* the contents are interned paths, see paths.h */
+#define ENTRY_MAGIC_PATHS 0x31504454 /* TDP1 */
+/* never stored, marks contents expanded in memory by borrow */
+#define ENTRY_MAGIC_EXPANDED 0x31584454 /* TDX1 */
+#define STAMP_KEY "tdpkg:stamp"
+/* the stat of the order the cache was last laid out in, see layout.h */
+#define LAYOUT_KEY "tdpkg:layout"
+/* tdpkg.lock in the admin directory is held while writing the cache.
+   Readers never take it: backends publish each batch as a whole and
+   readers keep what they had opened */
+#define CACHE_LOCK_NAME "tdpkg.lock"
+/* tdpkg.dirty in the admin directory is created by the first list file
+   written through and removed along with the next stamp, the cache isn't
+   trusted meanwhile. Unlike removing the stamp it costs no batch */
+#define CACHE_DIRTY_NAME "tdpkg.dirty"
+
+struct EntryHeader
+{
+  uint32_t magic;
+  uint32_t mtime_nsec;
+  int64_t mtime;
+  uint64_t size;
+  uint64_t ino;
+};
+
+/* what the cache knows about a list file, used while reconciling */
+struct Known
+{
+  char* filename;
+  uint32_t hash;
+  int seen;
+  struct EntryHeader header;
+};
+
+struct KnownTable
+{
+  struct Known* known;
+  uint32_t n_known;
+  uint32_t n_buckets;
+  uint32_t* buckets;
+};
+
+static int checked = 0;
+static int trusted = 0;
+/* set once this process writes through, tdpkg.dirty is created at the
+   same time so that a crash before the journal is committed leaves a
+   cache whose entries are all checked */
+static int dirty = 0;
+static int in_sync = 0;
+/* TDPKG_COMPRESS=1 stores new entries block-compressed,
+   TDPKG_COMPRESS=paths as interned paths */
+static uint32_t entry_magic = ENTRY_MAGIC;
+/* TDPKG_PREFETCH=1 reads the whole cache in the arena on the first
+   borrow, dpkg opens every list file right after anyway */
+static int prefetch = 0;
+static int prefetched = 0;
+/* TDPKG_CHECKPOINT=n commits the journal every n list files written,
+   otherwise it's committed on finalize */
+static int checkpoint = 0;
+/* TDPKG_BACKGROUND=1 rebuilds an out of date cache in a detached
+   process, list files are read from disk in the meantime */
+static int background = 0;
+static int spawned = 0;
+/* TDPKG_SERVER=0 never asks tdpkgd, which sets it for itself */
+static int ask_server = 1;
+/* the cache has been checked by tdpkgd, which also rebuilds it */
+static int served = 0;
+/* the batch begun keeps the owners index up to date, see owners.h */
+static int owners_indexed = 0;
+static int lock_fd = -1;
+
+static void
+_cache_header_init (struct EntryHeader* header, const struct stat* buf)
+{
+  header->magic = ENTRY_MAGIC;
+  header->mtime_nsec = buf->st_mtim.tv_nsec;
+  header->mtime = buf->st_mtim.tv_sec;
+  header->size = buf->st_size;
+  header->ino = buf->st_ino;
+}
+
+static int
+_cache_header_matches (const struct EntryHeader* header, const struct stat* buf)
+{
+  return header->mtime == buf->st_mtim.tv_sec
+    && header->mtime_nsec == buf->st_mtim.tv_nsec
+    && header->size == buf->st_size
+    && header->ino == buf->st_ino;
+}
+
+/* values may not be aligned, i.e. when mapped by the packed backend */
+static int
+_cache_header_parse (struct EntryHeader* header, const char* value, size_t len)
+{
+  if (len < sizeof (struct EntryHeader))
+    return -1;
+  memcpy (header, value, sizeof (struct EntryHeader));
+  if (header->magic != ENTRY_MAGIC && header->magic != ENTRY_MAGIC_BLOCKS
+      && header->magic != ENTRY_MAGIC_PATHS)
+    return -1;
+  return 0;
+}
+
+static int
+_cache_stat_dir (struct stat* stat_buf)
+{
+  if (tdpkg_stat (tdpkg_info_dir (), stat_buf))
+    {
+      fprintf (stderr, "tdpkg: can't stat %s: %s\n", tdpkg_info_dir (), strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+static int
+_cache_put_stat (const char* key, const struct stat* stat_buf)
+{
+  struct EntryHeader stamp;
+  _cache_header_init (&stamp, stat_buf);
+  return tdpkg_backend_put (key, (const char*)&stamp, sizeof (stamp));
+}
+
+static int
+_cache_stat_matches (const char* key, const struct stat* stat_buf)
+{
+  size_t len;
+  const char* value = tdpkg_backend_get (key, &len);
+  if (!value)
+    return 0;
+
+  struct EntryHeader stamp;
+  int matches = !_cache_header_parse (&stamp, value, len) && _cache_header_matches (&stamp, stat_buf);
+  tdpkg_backend_release (value);
+  return matches;
+}
+
+/* writers take turns, so that each batch starts from the cache
+   committed by the previous one */
+static int
+_cache_lock (void)
+{
+  char* lock_file = tdpkg_admin_path (CACHE_LOCK_NAME);
+  lock_fd = open (lock_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock_fd < 0)
+    {
+      fprintf (stderr, "tdpkg: can't open %s: %s\n", lock_file, strerror (errno));
+      free (lock_file);
+      return -1;
+    }
+  while (flock (lock_fd, LOCK_EX))
+    {
+      if (errno == EINTR)
+        continue;
+      fprintf (stderr, "tdpkg: can't lock %s: %s\n", lock_file, strerror (errno));
+      free (lock_file);
+      close (lock_fd);
+      lock_fd = -1;
+      return -1;
+    }
+  free (lock_file);
+  return 0;
+}
+
+static void
+_cache_unlock (void)
+{
+  close (lock_fd);
+  lock_fd = -1;
+}
+
+/* the stamp only holds without tdpkg.dirty */
+static int
+_cache_stamp_matches (const struct stat* dir_buf)
+{
+  if (!_cache_stat_matches (STAMP_KEY, dir_buf))
+    return 0;
+  char* dirty_file = tdpkg_admin_path (CACHE_DIRTY_NAME);
+  int clean = access (dirty_file, F_OK) && errno == ENOENT;
+  free (dirty_file);
+  return clean;
+}
+
+/* called with the lock held once the stamp is committed */
+static void
+_cache_mark_clean (void)
+{
+  char* dirty_file = tdpkg_admin_path (CACHE_DIRTY_NAME);
+  if (unlink (dirty_file) && errno != ENOENT)
+    fprintf (stderr, "tdpkg: can't remove %s: %s\n", dirty_file, strerror (errno));
+  free (dirty_file);
+}
+
+/* returns 1 when tdpkgd isn't running, the cache is then checked here */
+static int
+_cache_open_served (void)
+{
+  int fd;
+  int state = tdpkg_server_query (tdpkg_backend_name (), &fd);
+  if (state < 0)
+    return 1;
+  if (fd >= 0 ? tdpkg_backend_open_fd (fd) : tdpkg_backend_open (0))
+    return 1;
+
+  checked = 1;
+  trusted = state == TDPKG_SERVED_FRESH;
+  in_sync = trusted;
+  served = 1;
+  return 0;
+}
+
+static int
+_cache_open (int write)
+{
+  if (!checked && !write && ask_server && !_cache_open_served ())
+    return 0;
+  if (tdpkg_backend_open (write))
+    return -1;
+
+  if (checked)
+    return 0;
+  checked = 1;
+
+  /* ensure cache consistency with the file system */
+  uint64_t start = tdpkg_stats_start ();
+  struct stat stat_buf;
+  if (_cache_stat_dir (&stat_buf))
+    return -1;
+
+  /* a new cache, or one written by an older tdpkg, has no stamp and
+     every lookup misses until it's rebuilt */
+  trusted = _cache_stamp_matches (&stat_buf);
+  in_sync = trusted;
+  tdpkg_stats_stop (TDPKG_TIMER_FRESHNESS, start);
+  TDPKG_PROBE1 (freshness, trusted);
+
+#ifdef TDPKG_INFO
+  if (!trusted)
+    fprintf (stderr, "tdpkg: %s changed, checking list files on open\n", tdpkg_info_dir ());
+#endif
+  return 0;
+}
+
+/* called with the lock held. Interned paths and owners loaded before may
+   predate what another writer committed since, they're loaded again from
+   the cache the batch starts from */
+static int
+_cache_begin (void)
+{
+  if (tdpkg_backend_begin ())
+    return -1;
+  tdpkg_paths_reset ();
+  tdpkg_owners_reset ();
+  owners_indexed = tdpkg_owners_is_indexed ();
+  return 0;
+}
+
+/* interned paths and owners added by the batch are gone with it */
+static void
+_cache_abort (void)
+{
+  tdpkg_backend_abort ();
+  tdpkg_paths_reset ();
+  tdpkg_owners_reset ();
+  owners_indexed = 0;
+}
+
+static void
+_cache_release_value (const char* value)
+{
+  if (tdpkg_arena_release (value))
+    tdpkg_backend_release (value);
+}
+
+static int
+_cache_is_list (const char* filename)
+{
+  size_t len = strlen (filename);
+  return len > 5 && !strcmp (filename + len - 5, ".list");
+}
+
+/* the contents of the entry last committed for filename, newly allocated
+   and followed by a '\0'. Returns 0 with NULL contents when there's none */
+static int
+_cache_get_contents (const char* filename, char** contents, size_t* len)
+{
+  *contents = NULL;
+  size_t value_len;
+  const char* value = tdpkg_backend_get (filename, &value_len);
+  if (!value)
+    return 0;
+
+  struct EntryHeader header;
+  if (_cache_header_parse (&header, value, value_len))
+    {
+      tdpkg_backend_release (value);
+      return -1;
+    }
+  const char* data = value + sizeof (header);
+  *len = value_len - sizeof (header);
+  if (header.magic == ENTRY_MAGIC_PATHS)
+    *contents = tdpkg_paths_expand (data, *len, 0, len);
+  else if (header.magic == ENTRY_MAGIC_BLOCKS)
+    {
+      TdpkgBlocks blocks;
+      if (!tdpkg_blocks_open (&blocks, data, *len) && blocks.len == header.size)
+        {
+          *len = blocks.len;
+          *contents = malloc (*len + 1);
+          if (tdpkg_blocks_pread (&blocks, *contents, *len, 0) != *len)
+            {
+              free (*contents);
+              *contents = NULL;
+            }
+          else
+            (*contents)[*len] = '\0';
+          tdpkg_blocks_close (&blocks);
+        }
+    }
+  else
+    {
+      *contents = malloc (*len + 1);
+      memcpy (*contents, data, *len);
+      (*contents)[*len] = '\0';
+    }
+  tdpkg_backend_release (value);
+  return *contents ? 0 : -1;
+}
+
+/* called before the entry of filename is replaced by contents, or
+   deleted when contents is NULL */
+static int
+_cache_index_owners (const char* filename, const char* contents, size_t len)
+{
+  if (!owners_indexed || !_cache_is_list (filename))
+    return 0;
+
+  char* old = NULL;
+  size_t old_len = 0;
+  if (!tdpkg_owners_enabled || _cache_get_contents (filename, &old, &old_len))
+    {
+      /* built again on the next query */
+      tdpkg_owners_reset ();
+      owners_indexed = 0;
+      return tdpkg_owners_mark (0);
+    }
+
+  const char* name = strrchr (filename, '/') + 1;
+  char* package = strndup (name, strlen (name) - 5);
+  tdpkg_owners_update (package, old, old_len, contents, len);
+  free (package);
+  free (old);
+  return 0;
+}
+
+static int
+_cache_delete (const char* filename)
+{
+  tdpkg_arena_forget (filename);
+  if (_cache_index_owners (filename, NULL, 0))
+    return -1;
+  return tdpkg_backend_delete (filename);
+}
+
+/* only list files are made of paths worth interning */
+static uint32_t
+_cache_entry_magic (const char* filename)
+{
+  if (entry_magic != ENTRY_MAGIC_PATHS)
+    return entry_magic;
+  return _cache_is_list (filename) ? ENTRY_MAGIC_PATHS : ENTRY_MAGIC;
+}
+
+/* value holds the contents of filename after room for the header */
+static int
+_cache_put_value (const char* filename, char* value, const struct stat* stat_buf)
+{
+  tdpkg_arena_forget (filename);
+
+  size_t len = stat_buf->st_size;
+  if (_cache_index_owners (filename, value + sizeof (struct EntryHeader), len))
+    return -1;
+
+  struct EntryHeader header;
+  _cache_header_init (&header, stat_buf);
+  uint32_t magic = _cache_entry_magic (filename);
+  if (magic == ENTRY_MAGIC)
+    {
+      memcpy (value, &header, sizeof (header));
+      return tdpkg_backend_put (filename, value, sizeof (header) + len);
+    }
+
+  char* compressed;
+  if (magic == ENTRY_MAGIC_PATHS)
+    compressed = tdpkg_paths_encode (value + sizeof (header), len, sizeof (header), &len);
+  else
+    compressed = tdpkg_blocks_compress (value + sizeof (header), len, sizeof (header), &len);
+  if (!compressed)
+    return -1;
+  header.magic = magic;
+  memcpy (compressed, &header, sizeof (header));
+  int result = tdpkg_backend_put (filename, compressed, sizeof (header) + len);
+  free (compressed);
+  return result;
+}
+
+static int
+_cache_commit_entry (const char* filename, char* value, const struct stat* buf, void* data)
+{
+  if (!value)
+    return _cache_delete (filename);
+  return _cache_put_value (filename, value, buf);
+}
+
+static int
+_cache_write_journal (int stamp)
+{
+  struct stat stat_buf;
+  if (stamp && _cache_stat_dir (&stat_buf))
+    stamp = 0;
+  if (!stamp && !tdpkg_journal_length ())
+    return 0;
+
+  if (_cache_lock ())
+    {
+      tdpkg_journal_clear ();
+      in_sync = 0;
+      return -1;
+    }
+  if (_cache_begin ())
+    {
+      _cache_unlock ();
+      tdpkg_journal_clear ();
+      in_sync = 0;
+      return -1;
+    }
+  if (tdpkg_journal_foreach (_cache_commit_entry, NULL) || tdpkg_paths_flush () || tdpkg_owners_flush (0)
+      || (stamp && _cache_put_stat (STAMP_KEY, &stat_buf)) || tdpkg_backend_commit ())
+    {
+      _cache_abort ();
+      _cache_unlock ();
+      tdpkg_journal_clear ();
+      in_sync = 0;
+      return -1;
+    }
+  owners_indexed = 0;
+  if (stamp)
+    _cache_mark_clean ();
+  _cache_unlock ();
+  tdpkg_journal_clear ();
+  return 0;
+}
+
+/* the pending writes go in a single batch, along with the stamp if the
+   cache is known to be in sync */
+static int
+_cache_commit_journal (int stamp)
+{
+  uint64_t start = tdpkg_stats_start ();
+  int result = _cache_write_journal (stamp);
+  tdpkg_stats_stop (TDPKG_TIMER_COMMIT, start);
+  return result;
+}
+
+static int
+_cache_mark_dirty (void)
+{
+  if (dirty)
+    return 0;
+  dirty = 1;
+  char* dirty_file = tdpkg_admin_path (CACHE_DIRTY_NAME);
+  int fd = open (dirty_file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      fprintf (stderr, "tdpkg: can't create %s: %s\n", dirty_file, strerror (errno));
+      free (dirty_file);
+      in_sync = 0;
+      return -1;
+    }
+  close (fd);
+  free (dirty_file);
+  return 0;
+}
+
+/* the stamp is checked right away, before this process changes the
+   info directory itself */
+int
+tdpkg_cache_initialize (void)
+{
+  TDPKG_PROBE (init_entry);
+  if (tdpkg_backend_initialize ())
+    {
+      TDPKG_PROBE1 (init_return, -1);
+      return -1;
+    }
+
+  const char* compress = getenv ("TDPKG_COMPRESS");
+  if (!compress || !*compress || !strcmp (compress, "0"))
+    entry_magic = ENTRY_MAGIC;
+  else if (!strcmp (compress, "paths"))
+    entry_magic = ENTRY_MAGIC_PATHS;
+  else
+    entry_magic = ENTRY_MAGIC_BLOCKS;
+
+  const char* bulk = getenv ("TDPKG_PREFETCH");
+  prefetch = bulk && *bulk && strcmp (bulk, "0");
+  const char* every = getenv ("TDPKG_CHECKPOINT");
+  checkpoint = every ? atoi (every) : 0;
+  const char* detach = getenv ("TDPKG_BACKGROUND");
+  background = detach && *detach && strcmp (detach, "0");
+  const char* server = getenv ("TDPKG_SERVER");
+  ask_server = !server || strcmp (server, "0");
+  tdpkg_layout_initialize ();
+  tdpkg_owners_initialize ();
+  int result = _cache_open (0);
+  TDPKG_PROBE1 (init_return, result);
+  return result;
+}
+
+/* drops the state of this process without writing anything */
+static void
+_cache_reset (void)
+{
+  tdpkg_journal_clear ();
+  tdpkg_layout_reset ();
+  tdpkg_paths_reset ();
+  tdpkg_owners_reset ();
+  tdpkg_arena_free ();
+  prefetched = 0;
+  tdpkg_backend_close ();
+  checked = 0;
+  trusted = 0;
+  dirty = 0;
+  in_sync = 0;
+  spawned = 0;
+  served = 0;
+}
+
+static void _cache_save_layout (void);
+
+void
+tdpkg_cache_finalize (void)
+{
+  /* this process changed the info directory itself, and every list file
+     it touched is in the journal */
+  if (checked && dirty)
+    _cache_commit_journal (trusted && in_sync);
+  /* a rebuild going on in the background lays the cache out itself */
+  if (checked && tdpkg_layout_enabled && !spawned)
+    _cache_save_layout ();
+  _cache_reset ();
+}
+
+const char*
+tdpkg_cache_borrow_filename (const char* filename, size_t* len, int* compressed)
+{
+  if (_cache_open (0))
+    return NULL;
+  if (tdpkg_layout_enabled)
+    tdpkg_layout_record (filename);
+
+  /* written by this process and not committed yet */
+  const char* pending;
+  const struct stat* pending_stat;
+  if (tdpkg_journal_lookup (filename, &pending, &pending_stat))
+    {
+      if (!pending)
+        return NULL;
+      struct EntryHeader header;
+      _cache_header_init (&header, pending_stat);
+      header.magic = ENTRY_MAGIC_EXPANDED;
+      *compressed = 0;
+      *len = pending_stat->st_size;
+      char* copy = malloc (sizeof (header) + *len + 1);
+      memcpy (copy, &header, sizeof (header));
+      memcpy (copy + sizeof (header), pending + sizeof (header), *len + 1);
+      return copy + sizeof (header);
+    }
+
+  if (prefetch && !prefetched)
+    {
+      prefetched = 1;
+      tdpkg_arena_load ();
+    }
+
+  size_t value_len;
+  const char* value = tdpkg_arena_get (filename, &value_len);
+  if (!value)
+    value = tdpkg_backend_get (filename, &value_len);
+  if (!value)
+    return NULL;
+
+  struct EntryHeader header;
+  if (_cache_header_parse (&header, value, value_len)
+      || (header.magic == ENTRY_MAGIC && header.size != value_len - sizeof (header)))
+    {
+      _cache_release_value (value);
+      return NULL;
+    }
+
+  if (!trusted)
+    {
+      uint64_t start = tdpkg_stats_start ();
+      struct stat stat_buf;
+      int fresh = !tdpkg_stat (filename, &stat_buf) && _cache_header_matches (&header, &stat_buf);
+      tdpkg_stats_stop (TDPKG_TIMER_FRESHNESS, start);
+      if (!fresh)
+        {
+          _cache_release_value (value);
+          return NULL;
+        }
+    }
+
+  *compressed = header.magic == ENTRY_MAGIC_BLOCKS;
+  *len = value_len - sizeof (struct EntryHeader);
+  /* blocks are only inflated as they're read, their length is checked
+     like the length of plain contents */
+  if (*compressed)
+    {
+      TdpkgBlocks blocks;
+      int valid = !tdpkg_blocks_open (&blocks, value + sizeof (header), *len) && blocks.len == header.size;
+      tdpkg_blocks_close (&blocks);
+      if (!valid)
+        {
+          _cache_release_value (value);
+          return NULL;
+        }
+    }
+  if (header.magic != ENTRY_MAGIC_PATHS)
+    return value + sizeof (struct EntryHeader);
+
+  char* expanded = tdpkg_paths_expand (value + sizeof (header), *len, sizeof (header), len);
+  _cache_release_value (value);
+  if (!expanded)
+    return NULL;
+  if (*len != header.size)
+    {
+      free (expanded);
+      return NULL;
+    }
+  header.magic = ENTRY_MAGIC_EXPANDED;
+  memcpy (expanded, &header, sizeof (header));
+  return expanded + sizeof (struct EntryHeader);
+}
+
+void
+tdpkg_cache_release_filename (const char* contents)
+{
+  uint32_t magic;
+  memcpy (&magic, contents - sizeof (struct EntryHeader), sizeof (magic));
+  if (magic == ENTRY_MAGIC_EXPANDED)
+    free ((char*) contents - sizeof (struct EntryHeader));
+  else
+    _cache_release_value (contents - sizeof (struct EntryHeader));
+}
+
+static int
+_cache_checkpoint (void)
+{
+  if (checkpoint > 0 && tdpkg_journal_length () >= checkpoint)
+    return _cache_commit_journal (0);
+  return 0;
+}
+
+int
+tdpkg_cache_write_filename (const char* filename)
+{
+  /* left to the background rebuild */
+  if (spawned)
+    return 0;
+  if (_cache_open (1) || _cache_mark_dirty ())
+    return -1;
+
+  struct stat stat_buf;
+  char* value = tdpkg_read_file (filename, &stat_buf, sizeof (struct EntryHeader));
+  if (!value)
+    {
+      in_sync = 0;
+      return -1;
+    }
+
+  tdpkg_journal_put (filename, value, &stat_buf);
+  return _cache_checkpoint ();
+}
+
+/* contents have been captured while filename was written, only a stat
+   is needed unless they don't match */
+int
+tdpkg_cache_write_contents (const char* filename, const char* contents, size_t len)
+{
+  struct stat stat_buf;
+  if (spawned)
+    return 0;
+  if (tdpkg_stat (filename, &stat_buf) || stat_buf.st_size != len)
+    return tdpkg_cache_write_filename (filename);
+
+  if (_cache_open (1) || _cache_mark_dirty ())
+    return -1;
+
+  char* value = malloc (sizeof (struct EntryHeader) + len + 1);
+  memcpy (value + sizeof (struct EntryHeader), contents, len);
+  value[sizeof (struct EntryHeader) + len] = '\0';
+
+  tdpkg_journal_put (filename, value, &stat_buf);
+  return _cache_checkpoint ();
+}
+
+int
+tdpkg_cache_delete_filename (const char* filename)
+{
+  if (spawned)
+    return 0;
+  if (_cache_open (1) || _cache_mark_dirty ())
+    return -1;
+
+  tdpkg_journal_delete (filename);
+  return _cache_checkpoint ();
+}
+
+static int
+_cache_collect_known (const char* key, const char* value, size_t len, void* data)
+{
+  struct KnownTable* table = data;
+  if (*key != '/')
+    return 0;
+
+  table->known = realloc (table->known, (table->n_known+1) * sizeof (struct Known));
+  struct Known* known = &table->known[table->n_known++];
+  known->filename = strdup (key);
+  known->hash = tdpkg_hash (key, strlen (key));
+  known->seen = 0;
+  /* a value we can't parse never matches a list file */
+  if (len < sizeof (struct EntryHeader) || _cache_header_parse (&known->header, value, sizeof (struct EntryHeader)))
+    memset (&known->header, '\0', sizeof (struct EntryHeader));
+  return 0;
+}
+
+static void
+_cache_known_index (struct KnownTable* table)
+{
+  table->n_buckets = 16;
+  while (table->n_buckets < table->n_known*2)
+    table->n_buckets <<= 1;
+  table->buckets = malloc (table->n_buckets * sizeof (uint32_t));
+  memset (table->buckets, 0xff, table->n_buckets * sizeof (uint32_t));
+
+  uint32_t mask = table->n_buckets-1;
+  uint32_t i;
+  for (i=0; i < table->n_known; i++)
+    {
+      uint32_t b = table->known[i].hash & mask;
+      while (table->buckets[b] != UINT32_MAX)
+        b = (b+1) & mask;
+      table->buckets[b] = i;
+    }
+}
+
+static struct Known*
+_cache_known_lookup (struct KnownTable* table, const char* filename)
+{
+  uint32_t mask = table->n_buckets-1;
+  uint32_t b;
+  for (b = tdpkg_hash (filename, strlen (filename)) & mask; table->buckets[b] != UINT32_MAX; b = (b+1) & mask)
+    if (!strcmp (table->known[table->buckets[b]].filename, filename))
+      return &table->known[table->buckets[b]];
+  return NULL;
+}
+
+static void
+_cache_known_free (struct KnownTable* table)
+{
+  uint32_t i;
+  for (i=0; i < table->n_known; i++)
+    free (table->known[i].filename);
+  free (table->known);
+  free (table->buckets);
+}
+
+struct Reconcile
+{
+  struct KnownTable* table;
+  int n_updated;
+};
+
+/* called by the loading threads, the table is only read */
+static int
+_cache_reconcile_check (const char* filename, const struct stat* buf, void* data)
+{
+  struct Reconcile* reconcile = data;
+  struct Known* known = _cache_known_lookup (reconcile->table, filename);
+  /* entries stored the other way are converted too */
+  return known && known->header.magic == _cache_entry_magic (filename)
+    && _cache_header_matches (&known->header, buf);
+}
+
+static int
+_cache_reconcile_file (TdpkgLoadedFile* file, void* data)
+{
+  struct Reconcile* reconcile = data;
+  struct Known* known = _cache_known_lookup (reconcile->table, file->filename);
+  if (known)
+    known->seen = 1;
+  if (file->state == TDPKG_UNCHANGED)
+    return 0;
+
+  printf ("tdpkg: (Indexing list file %d...)\r", ++reconcile->n_updated);
+  if (file->state == TDPKG_MISSING)
+    return _cache_delete (file->filename);
+
+  return _cache_put_value (file->filename, file->value, &file->stat);
+}
+
+/* the grandchild rebuilds the cache on its own, in a new session and
+   without any of the descriptors of dpkg, whose frontend may wait for
+   them to be closed. The new cache is published by the commit */
+static int
+_cache_spawn_rebuild (void)
+{
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      fprintf (stderr, "tdpkg: can't fork: %s\n", strerror (errno));
+      return -1;
+    }
+  if (pid > 0)
+    {
+      waitpid (pid, NULL, 0);
+      return 0;
+    }
+
+  if (setsid () < 0 || fork () != 0)
+    _exit (0);
+
+  _cache_reset ();
+  /* close_range came with 5.9, dpkg's descriptors are closed one by one
+     without it, its locks among them */
+  int closed = -1;
+#ifdef SYS_close_range
+  closed = syscall (SYS_close_range, 3, ~0U, 0);
+#endif
+  if (closed)
+    {
+      long fd, max_fd = sysconf (_SC_OPEN_MAX);
+      for (fd=3; fd < max_fd; fd++)
+        close (fd);
+    }
+  int null_fd = open ("/dev/null", O_RDWR);
+  if (null_fd >= 0)
+    {
+      dup2 (null_fd, 0);
+      dup2 (null_fd, 1);
+      dup2 (null_fd, 2);
+      if (null_fd > 2)
+        close (null_fd);
+    }
+
+  int result = tdpkg_cache_rebuild ();
+  _cache_reset ();
+  _exit (result ? 1 : 0);
+}
+
+/* called when filename missed, returns 0 if it has been indexed and 1
+   if there's nothing to index or it has to be read from disk */
+int
+tdpkg_cache_refresh_filename (const char* filename)
+{
+  /* tdpkgd is rebuilding it */
+  if (spawned || (served && !in_sync))
+    return 1;
+
+  /* the info directory changed behind our back, other list files
+     most likely changed too */
+  int rebuilt = !in_sync;
+  if (rebuilt && background && !_cache_spawn_rebuild ())
+    {
+#ifdef TDPKG_INFO
+      fprintf (stderr, "tdpkg: rebuilding cache in the background\n");
+#endif
+      /* the pending writes are superseded by the list files on disk */
+      tdpkg_journal_clear ();
+      dirty = 0;
+      spawned = 1;
+      return 1;
+    }
+  if (rebuilt && tdpkg_cache_rebuild ())
+    return -1;
+
+  /* most of the time the file just doesn't exist */
+  struct stat stat_buf;
+  if (tdpkg_stat (filename, &stat_buf))
+    return 1;
+  if (rebuilt)
+    return 0;
+
+  return tdpkg_cache_write_filename (filename);
+}
+
+struct Relayout
+{
+  struct KnownTable* table;
+  int failed;
+};
+
+/* list files left out of the order and the other keys go last */
+static int
+_cache_relayout_rest (const char* key, const char* value, size_t len, void* data)
+{
+  struct Relayout* relayout = data;
+  if (*key == '/')
+    {
+      struct Known* known = _cache_known_lookup (relayout->table, key);
+      if (known && known->seen)
+        return 0;
+    }
+  else if (!strcmp (key, LAYOUT_KEY))
+    return 0;
+
+  if (tdpkg_backend_put (key, value, len))
+    {
+      relayout->failed = 1;
+      return 1;
+    }
+  return 0;
+}
+
+/* called with the lock held once the cache is committed, rewrites it in
+   the saved order unless it was left laid out in it */
+static int
+_cache_relayout_locked (int changed)
+{
+  struct stat order_stat;
+  int n_order;
+  char** order = tdpkg_layout_load (&n_order, &order_stat);
+  if (!order)
+    return 0;
+
+  if (!changed && _cache_stat_matches (LAYOUT_KEY, &order_stat))
+    {
+      tdpkg_free_files (order, n_order);
+      return 0;
+    }
+
+  int began = tdpkg_backend_begin_ordered ();
+  if (began)
+    {
+      tdpkg_free_files (order, n_order);
+      return began > 0 ? 0 : -1;
+    }
+
+  struct KnownTable table;
+  memset (&table, '\0', sizeof (table));
+  if (tdpkg_backend_foreach (sizeof (struct EntryHeader), _cache_collect_known, &table))
+    {
+      _cache_known_free (&table);
+      tdpkg_free_files (order, n_order);
+      _cache_abort ();
+      return -1;
+    }
+  _cache_known_index (&table);
+
+  int i;
+  for (i=0; i < n_order; i++)
+    {
+      struct Known* known = _cache_known_lookup (&table, order[i]);
+      if (!known || known->seen)
+        continue;
+      size_t len;
+      const char* value = tdpkg_backend_get (order[i], &len);
+      if (!value)
+        continue;
+      int failed = tdpkg_backend_put (order[i], value, len);
+      tdpkg_backend_release (value);
+      if (failed)
+        break;
+      known->seen = 1;
+    }
+  tdpkg_free_files (order, n_order);
+
+  struct Relayout relayout;
+  relayout.table = &table;
+  relayout.failed = 0;
+  if (i < n_order || tdpkg_backend_foreach (0, _cache_relayout_rest, &relayout) || relayout.failed
+      || _cache_put_stat (LAYOUT_KEY, &order_stat) || tdpkg_backend_commit ())
+    {
+      _cache_known_free (&table);
+      _cache_abort ();
+      return -1;
+    }
+  _cache_known_free (&table);
+  return 0;
+}
+
+static void
+_cache_save_layout (void)
+{
+  /* most processes leave the order as it is, they don't lock then */
+  if (!tdpkg_layout_changed ())
+    return;
+  if (tdpkg_backend_open (1) || _cache_lock ())
+    return;
+  int saved = tdpkg_layout_save ();
+  if (saved > 0 && _cache_relayout_locked (0))
+    fprintf (stderr, "tdpkg: can't lay the cache out, left as it is\n");
+  _cache_unlock ();
+}
+
+struct OwnersBuild
+{
+  char** lists;
+  int n_lists;
+  char** stale;
+  int n_stale;
+};
+
+static int
+_cache_collect_owners (const char* key, const char* value, size_t len, void* data)
+{
+  struct OwnersBuild* build = data;
+  if (tdpkg_owners_is_key (key))
+    {
+      build->stale = realloc (build->stale, (build->n_stale+1) * sizeof (char*));
+      build->stale[build->n_stale++] = strdup (key);
+    }
+  else if (*key == '/' && _cache_is_list (key))
+    {
+      build->lists = realloc (build->lists, (build->n_lists+1) * sizeof (char*));
+      build->lists[build->n_lists++] = strdup (key);
+    }
+  return 0;
+}
+
+/* called with the lock held, indexes the owners of every list file
+   cached in a batch of its own */
+static int
+_cache_build_owners_locked (void)
+{
+  if (_cache_begin ())
+    return -1;
+  /* built by another process while waiting for the lock */
+  if (owners_indexed)
+    {
+      _cache_abort ();
+      return 0;
+    }
+
+  struct OwnersBuild build;
+  memset (&build, '\0', sizeof (build));
+  int failed = tdpkg_backend_foreach (sizeof (struct EntryHeader), _cache_collect_owners, &build);
+
+  int i;
+  for (i=0; !failed && i < build.n_stale; i++)
+    failed = tdpkg_backend_delete (build.stale[i]);
+  for (i=0; !failed && i < build.n_lists; i++)
+    {
+      char* contents;
+      size_t len;
+      failed = _cache_get_contents (build.lists[i], &contents, &len);
+      if (failed || !contents)
+        continue;
+      const char* name = strrchr (build.lists[i], '/') + 1;
+      char* package = strndup (name, strlen (name) - 5);
+      tdpkg_owners_update (package, NULL, 0, contents, len);
+      free (package);
+      free (contents);
+    }
+  tdpkg_free_files (build.stale, build.n_stale);
+  tdpkg_free_files (build.lists, build.n_lists);
+
+  if (failed || tdpkg_owners_flush (1) || tdpkg_owners_mark (1) || tdpkg_backend_commit ())
+    {
+      _cache_abort ();
+      return -1;
+    }
+  owners_indexed = 0;
+  return 0;
+}
+
+/* called with the lock held, the batch is begun first so that the
+   cache committed by the last writer is the one reconciled */
+static int
+_cache_rebuild_locked (void)
+{
+  /* the stamp is taken first, changes done while indexing are caught
+     by the next run */
+  struct stat stat_buf;
+  if (_cache_stat_dir (&stat_buf))
+    return -1;
+
+  if (_cache_begin ())
+    return -1;
+
+  /* rebuilt by another process while waiting for the lock */
+  if (_cache_stamp_matches (&stat_buf))
+    {
+      _cache_abort ();
+      trusted = 1;
+      in_sync = 1;
+      dirty = 0;
+      return 0;
+    }
+
+  struct KnownTable table;
+  memset (&table, '\0', sizeof (table));
+  if (tdpkg_backend_foreach (sizeof (struct EntryHeader), _cache_collect_known, &table))
+    {
+      _cache_known_free (&table);
+      _cache_abort ();
+      return -1;
+    }
+  _cache_known_index (&table);
+
+  int n_filenames;
+  char** filenames = tdpkg_list_files (tdpkg_info_dir (), tdpkg_info_suffixes (), &n_filenames);
+  if (!filenames)
+    {
+      _cache_known_free (&table);
+      _cache_abort ();
+      return -1;
+    }
+
+  /* list files are read in parallel, the backend is only written here */
+  struct Reconcile reconcile;
+  reconcile.table = &table;
+  reconcile.n_updated = 0;
+  if (tdpkg_load_files (filenames, n_filenames, sizeof (struct EntryHeader),
+                        _cache_reconcile_check, _cache_reconcile_file, &reconcile))
+    {
+      tdpkg_free_files (filenames, n_filenames);
+      _cache_known_free (&table);
+      _cache_abort ();
+      return -1;
+    }
+  tdpkg_free_files (filenames, n_filenames);
+
+  int n_updated = reconcile.n_updated;
+  int n_removed = 0;
+  uint32_t j;
+  for (j=0; j < table.n_known; j++)
+    {
+      if (table.known[j].seen)
+        continue;
+      if (_cache_delete (table.known[j].filename))
+        {
+          _cache_known_free (&table);
+          _cache_abort ();
+          return -1;
+        }
+      n_removed++;
+    }
+  _cache_known_free (&table);
+
+  if (tdpkg_paths_flush () || tdpkg_owners_flush (0) || _cache_put_stat (STAMP_KEY, &stat_buf)
+      || tdpkg_backend_commit ())
+    {
+      _cache_abort ();
+      return -1;
+    }
+  _cache_mark_clean ();
+
+  trusted = 1;
+  in_sync = 1;
+  dirty = 0;
+  owners_indexed = 0;
+  if (n_updated || n_removed)
+    printf ("tdpkg: %d list files cached succefully, %d removed\n", n_updated, n_removed);
+  /* the list files have just been read, so is every entry to index */
+  int indexed = 0;
+  if (tdpkg_owners_enabled && !tdpkg_owners_is_indexed ())
+    {
+      if (_cache_build_owners_locked ())
+        fprintf (stderr, "tdpkg: can't index the owners of paths, left out of date\n");
+      else
+        indexed = 1;
+    }
+  if (tdpkg_layout_enabled && _cache_relayout_locked (n_updated || n_removed || indexed))
+    fprintf (stderr, "tdpkg: can't lay the cache out, left as it is\n");
+  return 0;
+}
+
+/* only list files whose metadata changed are read again, entries of
+   removed list files are deleted */
+int
+tdpkg_cache_rebuild (void)
+{
+  if (_cache_open (1))
+    return -1;
+  in_sync = 0;
+  /* the list files on disk supersede the pending writes */
+  tdpkg_journal_clear ();
+
+  if (_cache_lock ())
+    return -1;
+  TDPKG_STAT_ADD (TDPKG_STAT_REBUILDS, 1);
+  TDPKG_PROBE (rebuild_entry);
+  uint64_t start = tdpkg_stats_start ();
+  int result = _cache_rebuild_locked ();
+  tdpkg_stats_stop (TDPKG_TIMER_REBUILD, start);
+  TDPKG_PROBE1 (rebuild_return, result);
+  _cache_unlock ();
+  return result;
+}
+
+int
+tdpkg_cache_check (int* fd)
+{
+  /* other processes may have written the cache since */
+  _cache_reset ();
+  *fd = tdpkg_backend_share ();
+  if (*fd >= 0)
+    {
+      int own = fcntl (*fd, F_DUPFD_CLOEXEC, 0);
+      if (own < 0 || tdpkg_backend_open_fd (own))
+        {
+          close (*fd);
+          *fd = -1;
+        }
+    }
+
+  if (_cache_open (0))
+    {
+      if (*fd >= 0)
+        close (*fd);
+      *fd = -1;
+      return -1;
+    }
+  return trusted ? 0 : 1;
+}
+
+int
+tdpkg_cache_owners (const char* path, char** owners)
+{
+  *owners = NULL;
+  if (_cache_open (0))
+    return -1;
+  if (!in_sync && tdpkg_cache_rebuild ())
+    return -1;
+
+  if (!tdpkg_owners_is_indexed ())
+    {
+      if (!tdpkg_owners_enabled || tdpkg_backend_open (1) || _cache_lock ())
+        return -1;
+      int result = _cache_build_owners_locked ();
+      _cache_unlock ();
+      if (result)
+        return -1;
+    }
+
+  *owners = tdpkg_owners_lookup (path);
+  return 0;
+}
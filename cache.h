@@ -20,11 +20,31 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stddef.h>
+
 int tdpkg_cache_initialize (void);
 void tdpkg_cache_finalize (void);
-char* tdpkg_cache_read_filename (const char* filename);
+/* returned contents are owned by the cache and stay valid until released,
+   len is the stored length, contents may contain '\0'. When compressed is
+   set they have to be read through blocks.h */
+const char* tdpkg_cache_borrow_filename (const char* filename, size_t* len, int* compressed);
+void tdpkg_cache_release_filename (const char* contents);
 int tdpkg_cache_write_filename (const char* filename);
+/* like write_filename, contents being what has just been written */
+int tdpkg_cache_write_contents (const char* filename, const char* contents, size_t len);
 int tdpkg_cache_delete_filename (const char* filename);
+/* after a miss, 0 if filename has been indexed, 1 if it doesn't exist
+   or has to be read from disk */
+int tdpkg_cache_refresh_filename (const char* filename);
 int tdpkg_cache_rebuild (void);
+/* used by tdpkgd: checks the cache last committed, returns 0 if it's in
+   sync with the info directory and 1 if it has to be rebuilt. *fd is a
+   read-only descriptor of the cache checked, or -1 */
+int tdpkg_cache_check (int* fd);
+/* *owners is set to the packages whose list file holds path, each
+   followed by a '\n', or NULL if there's none. The index is built first
+   if it's out of date and TDPKG_OWNERS=1, otherwise -1 is returned.
+   Writes of this process not committed yet aren't seen */
+int tdpkg_cache_owners (const char* path, char** owners);
 
 #endif
@@ -0,0 +1,114 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "journal.h"
+
+struct JournalEntry
+{
+  char* filename;
+  char* value;
+  struct stat stat;
+};
+
+static struct JournalEntry* entries = NULL;
+static int n_entries = 0;
+static int n_alloc = 0;
+
+/* a file is written once or twice per package, a scan is enough */
+static struct JournalEntry*
+_journal_entry (const char* filename, int create)
+{
+  int i;
+  for (i=0; i < n_entries; i++)
+    if (!strcmp (entries[i].filename, filename))
+      return &entries[i];
+  if (!create)
+    return NULL;
+
+  if (n_entries == n_alloc)
+    {
+      n_alloc = n_alloc ? n_alloc*2 : 64;
+      entries = realloc (entries, n_alloc * sizeof (struct JournalEntry));
+    }
+  struct JournalEntry* entry = &entries[n_entries++];
+  entry->filename = strdup (filename);
+  entry->value = NULL;
+  return entry;
+}
+
+void
+tdpkg_journal_put (const char* filename, char* value, const struct stat* buf)
+{
+  struct JournalEntry* entry = _journal_entry (filename, 1);
+  free (entry->value);
+  entry->value = value;
+  entry->stat = *buf;
+}
+
+void
+tdpkg_journal_delete (const char* filename)
+{
+  struct JournalEntry* entry = _journal_entry (filename, 1);
+  free (entry->value);
+  entry->value = NULL;
+}
+
+int
+tdpkg_journal_lookup (const char* filename, const char** value, const struct stat** buf)
+{
+  struct JournalEntry* entry = _journal_entry (filename, 0);
+  if (!entry)
+    return 0;
+  *value = entry->value;
+  *buf = &entry->stat;
+  return 1;
+}
+
+int
+tdpkg_journal_length (void)
+{
+  return n_entries;
+}
+
+int
+tdpkg_journal_foreach (TdpkgJournalFunc func, void* data)
+{
+  int i;
+  for (i=0; i < n_entries; i++)
+    if (func (entries[i].filename, entries[i].value, &entries[i].stat, data))
+      return -1;
+  return 0;
+}
+
+void
+tdpkg_journal_clear (void)
+{
+  int i;
+  for (i=0; i < n_entries; i++)
+    {
+      free (entries[i].filename);
+      free (entries[i].value);
+    }
+  free (entries);
+  entries = NULL;
+  n_entries = n_alloc = 0;
+}
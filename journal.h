@@ -0,0 +1,40 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <sys/stat.h>
+
+/* List files written or removed by this process, kept in memory until
+   the cache commits them all in a single batch. */
+
+/* return non-zero to stop iterating, value is NULL for removed files */
+typedef int (*TdpkgJournalFunc) (const char* filename, char* value, const struct stat* buf, void* data);
+
+/* value is owned by the journal from now on */
+void tdpkg_journal_put (const char* filename, char* value, const struct stat* buf);
+void tdpkg_journal_delete (const char* filename);
+/* returns 1 if filename is pending, value is then NULL if it's removed */
+int tdpkg_journal_lookup (const char* filename, const char** value, const struct stat** buf);
+int tdpkg_journal_length (void);
+int tdpkg_journal_foreach (TdpkgJournalFunc func, void* data);
+void tdpkg_journal_clear (void);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "layout.h"
+#include "util.h"
+
+int tdpkg_layout_enabled = 0;
+
+static char** recorded = NULL;
+static int n_recorded = 0;
+static int n_alloc = 0;
+
+void
+tdpkg_layout_initialize (void)
+{
+  const char* layout = getenv ("TDPKG_LAYOUT");
+  tdpkg_layout_enabled = layout && *layout && strcmp (layout, "0");
+}
+
+void
+tdpkg_layout_record (const char* filename)
+{
+  if (n_recorded == n_alloc)
+    {
+      n_alloc = n_alloc ? n_alloc*2 : 1024;
+      recorded = realloc (recorded, n_alloc * sizeof (char*));
+    }
+  recorded[n_recorded++] = strdup (filename);
+}
+
+void
+tdpkg_layout_reset (void)
+{
+  int i;
+  for (i=0; i < n_recorded; i++)
+    free (recorded[i]);
+  free (recorded);
+  recorded = NULL;
+  n_recorded = 0;
+  n_alloc = 0;
+}
+
+/* drops all but the first occurrence of each filename, keeping the
+   order, returns the new count */
+static int
+_layout_unique (char** filenames, int n_filenames)
+{
+  uint32_t n_buckets = 16;
+  while (n_buckets < (uint32_t) n_filenames*2)
+    n_buckets <<= 1;
+  int* buckets = malloc (n_buckets * sizeof (int));
+  memset (buckets, 0xff, n_buckets * sizeof (int));
+
+  uint32_t mask = n_buckets-1;
+  int i, n_unique = 0;
+  for (i=0; i < n_filenames; i++)
+    {
+      uint32_t b;
+      for (b = tdpkg_hash (filenames[i], strlen (filenames[i])) & mask; buckets[b] >= 0; b = (b+1) & mask)
+        if (!strcmp (filenames[buckets[b]], filenames[i]))
+          break;
+      if (buckets[b] >= 0)
+        {
+          free (filenames[i]);
+          continue;
+        }
+      buckets[b] = n_unique;
+      filenames[n_unique++] = filenames[i];
+    }
+  free (buckets);
+  return n_unique;
+}
+
+static char**
+_layout_parse (char* contents, int* n_filenames)
+{
+  char** filenames = NULL;
+  int n = 0, alloc = 0;
+  char* line = contents;
+  while (*line)
+    {
+      char* end = strchr (line, '\n');
+      if (end)
+        *end = '\0';
+      if (*line == '/')
+        {
+          if (n == alloc)
+            {
+              alloc = alloc ? alloc*2 : 1024;
+              filenames = realloc (filenames, alloc * sizeof (char*));
+            }
+          filenames[n++] = strdup (line);
+        }
+      if (!end)
+        break;
+      line = end+1;
+    }
+  *n_filenames = _layout_unique (filenames, n);
+  return filenames ? filenames : malloc (sizeof (char*));
+}
+
+char**
+tdpkg_layout_load (int* n_filenames, struct stat* buf)
+{
+  char* order_file = tdpkg_admin_path (LAYOUT_ORDER_NAME);
+  char* contents = tdpkg_stat (order_file, buf) ? NULL : tdpkg_read_file_stat (order_file, buf, 0);
+  free (order_file);
+  if (!contents)
+    return NULL;
+
+  char** filenames = _layout_parse (contents, n_filenames);
+  free (contents);
+  return filenames;
+}
+
+/* the recorded order as saved, NULL if nothing was recorded */
+static char*
+_layout_contents (size_t* len)
+{
+  n_recorded = _layout_unique (recorded, n_recorded);
+  if (!n_recorded)
+    return NULL;
+
+  *len = 0;
+  int i;
+  for (i=0; i < n_recorded; i++)
+    *len += strlen (recorded[i]) + 1;
+  char* contents = malloc (*len + 1);
+  char* p = contents;
+  for (i=0; i < n_recorded; i++)
+    p = stpcpy (stpcpy (p, recorded[i]), "\n");
+  return contents;
+}
+
+/* dpkg -L and the like open a few list files, their order says nothing
+   about the next full run */
+static int
+_layout_replaces (const char* order_file, const char* contents)
+{
+  struct stat stat_buf;
+  char* saved = tdpkg_stat (order_file, &stat_buf) ? NULL : tdpkg_read_file_stat (order_file, &stat_buf, 0);
+  if (!saved)
+    return 1;
+
+  int n_saved = 0;
+  char* p;
+  for (p = saved; (p = strchr (p, '\n')); p++)
+    n_saved++;
+  int replace = n_recorded*2 >= n_saved && strcmp (saved, contents);
+  free (saved);
+  return replace;
+}
+
+int
+tdpkg_layout_changed (void)
+{
+  size_t len;
+  char* contents = _layout_contents (&len);
+  if (!contents)
+    return 0;
+  char* order_file = tdpkg_admin_path (LAYOUT_ORDER_NAME);
+  int replace = _layout_replaces (order_file, contents);
+  free (order_file);
+  free (contents);
+  return replace;
+}
+
+int
+tdpkg_layout_save (void)
+{
+  size_t len;
+  char* contents = _layout_contents (&len);
+  if (!contents)
+    return 0;
+
+  char* order_file = tdpkg_admin_path (LAYOUT_ORDER_NAME);
+  if (!_layout_replaces (order_file, contents))
+    {
+      free (contents);
+      free (order_file);
+      return 0;
+    }
+
+  char* tmp_file = malloc (strlen (order_file) + 5);
+  sprintf (tmp_file, "%s.tmp", order_file);
+  int fd = open (tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int failed = fd < 0 || write (fd, contents, len) != (ssize_t) len;
+  if (fd >= 0 && close (fd))
+    failed = 1;
+  if (failed || rename (tmp_file, order_file))
+    {
+      fprintf (stderr, "tdpkg: can't write %s: %s\n", order_file, strerror (errno));
+      unlink (tmp_file);
+      failed = 1;
+    }
+  free (tmp_file);
+  free (contents);
+  free (order_file);
+  return failed ? -1 : 1;
+}
@@ -0,0 +1,47 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <sys/stat.h>
+
+/* TDPKG_LAYOUT=1 records the list files this process opens, in order.
+   The order is saved in LAYOUT_ORDER_NAME in the admin directory, one
+   path per line, and the cache is rewritten in it so that the next run
+   reads it mostly sequentially. */
+#define LAYOUT_ORDER_NAME "tdpkg.order"
+
+extern int tdpkg_layout_enabled;
+
+void tdpkg_layout_initialize (void);
+void tdpkg_layout_record (const char* filename);
+/* replaces the saved order with the recorded one, unless it's the same
+   or this process opened less than half as many list files. Returns 1
+   if it was replaced, only one process may call it at a time */
+int tdpkg_layout_save (void);
+/* whether tdpkg_layout_save would replace the saved order, it takes no
+   lock */
+int tdpkg_layout_changed (void);
+/* the saved order without duplicates, NULL if there's none, free it
+   with tdpkg_free_files */
+char** tdpkg_layout_load (int* n_filenames, struct stat* buf);
+void tdpkg_layout_reset (void);
+
+#endif
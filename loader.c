@@ -0,0 +1,644 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+
+#include "loader.h"
+#include "uring.h"
+#include "util.h"
+
+/* List files are loaded ahead of the calling thread, which consumes them
+   in order as the single writer of the cache. Loading doesn't get further
+   than LOADER_WINDOW files ahead of it, which bounds the memory used.
+
+   When io_uring is available and supports them, each window is loaded by
+   the calling thread with a handful of system calls: the statx, openat,
+   read and close of all its files are submitted at once. Otherwise
+   they're stat'ed and read by a pool of threads. TDPKG_IO_URING=0 forces
+   the threads, TDPKG_THREADS sets their number and 1 loads everything in
+   the calling thread, asking the kernel to read ahead LOADER_PREFETCH
+   files. Only this one reads ahead: the ring and the threads already
+   have many files being read at once. Files are stat'ed as they're read
+   ahead. */
+#define LOADER_MAX_THREADS 16
+#define LOADER_WINDOW 256
+#define LOADER_PREFETCH 16
+
+struct Loader
+{
+  size_t offset;
+  TdpkgLoaderCheck check;
+  void* data;
+  TdpkgLoadedFile* files;
+  char* done;
+  int n_files;
+  int next;
+  int consumed;
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t space;
+};
+
+static int
+_loader_n_threads (int n_files)
+{
+  const char* threads = getenv ("TDPKG_THREADS");
+  long n = threads && *threads ? atol (threads) : sysconf (_SC_NPROCESSORS_ONLN);
+  if (n > LOADER_MAX_THREADS)
+    n = LOADER_MAX_THREADS;
+  if (n > n_files)
+    n = n_files;
+  /* a single thread is the calling one */
+  return n > 1 ? n : 0;
+}
+
+/* sets the state of file, only loaded files are left to read */
+static int
+_loader_stat (struct Loader* loader, TdpkgLoadedFile* file)
+{
+  file->state = TDPKG_LOADED;
+  if (tdpkg_stat (file->filename, &file->stat))
+    {
+      if (errno == ENOENT)
+        {
+          file->state = TDPKG_MISSING;
+          return 0;
+        }
+      fprintf (stderr, "tdpkg: can't stat %s: %s\n", file->filename, strerror (errno));
+      return -1;
+    }
+
+  if (loader->check && loader->check (file->filename, &file->stat, loader->data))
+    {
+      file->state = TDPKG_UNCHANGED;
+      return 0;
+    }
+  return 0;
+}
+
+/* file is read with the stat the check was given, and checked again
+   if it changed in between */
+static int
+_loader_read (struct Loader* loader, TdpkgLoadedFile* file)
+{
+  int retried = 0;
+  while (file->state == TDPKG_LOADED)
+    {
+      file->value = tdpkg_read_file_stat (file->filename, &file->stat, loader->offset);
+      if (file->value)
+        return 0;
+      if (errno != ESTALE)
+        return -1;
+      if (retried++)
+        {
+          fprintf (stderr, "tdpkg: %s keeps changing while being read\n", file->filename);
+          return -1;
+        }
+      if (_loader_stat (loader, file))
+        return -1;
+    }
+  return 0;
+}
+
+static int
+_loader_load (struct Loader* loader, TdpkgLoadedFile* file)
+{
+  if (_loader_stat (loader, file))
+    return -1;
+  return _loader_read (loader, file);
+}
+
+/* stats file ahead of reading it, and asks the kernel to read it ahead
+   unless it's left unread */
+static int
+_loader_prefetch (struct Loader* loader, TdpkgLoadedFile* file)
+{
+  if (_loader_stat (loader, file))
+    return -1;
+  if (file->state != TDPKG_LOADED)
+    return 0;
+
+  /* bypass the wrappers of tdpkg.c */
+  int fd = syscall (SYS_openat, AT_FDCWD, file->filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+  syscall (SYS_close, fd);
+  return 0;
+}
+
+static void*
+_loader_thread (void* data)
+{
+  struct Loader* loader = data;
+
+  pthread_mutex_lock (&loader->lock);
+  for (;;)
+    {
+      while (!loader->failed && loader->next < loader->n_files
+             && loader->next >= loader->consumed + LOADER_WINDOW)
+        pthread_cond_wait (&loader->space, &loader->lock);
+      if (loader->failed || loader->next >= loader->n_files)
+        break;
+
+      int i = loader->next++;
+      pthread_mutex_unlock (&loader->lock);
+      int result = _loader_load (loader, &loader->files[i]);
+      pthread_mutex_lock (&loader->lock);
+
+      if (result)
+        loader->failed = 1;
+      loader->done[i] = 1;
+      pthread_cond_broadcast (&loader->ready);
+    }
+  pthread_mutex_unlock (&loader->lock);
+  return NULL;
+}
+
+static int
+_loader_run_threads (struct Loader* loader, TdpkgLoaderFunc func, void* data)
+{
+  int n_threads = _loader_n_threads (loader->n_files);
+  pthread_t threads[LOADER_MAX_THREADS];
+  int n_started = 0;
+  while (n_started < n_threads
+         && !pthread_create (&threads[n_started], NULL, _loader_thread, loader))
+    n_started++;
+
+  int result = 0;
+  int i;
+  if (!n_started)
+    for (i=0; i < LOADER_PREFETCH && i < loader->n_files && !result; i++)
+      result = _loader_prefetch (loader, &loader->files[i]);
+
+  for (i=0; i < loader->n_files && !result; i++)
+    {
+      TdpkgLoadedFile* file = &loader->files[i];
+      if (!n_started)
+        {
+          if (i + LOADER_PREFETCH < loader->n_files)
+            result = _loader_prefetch (loader, &loader->files[i + LOADER_PREFETCH]);
+          if (!result)
+            result = _loader_read (loader, file);
+        }
+      else
+        {
+          pthread_mutex_lock (&loader->lock);
+          while (!loader->done[i] && !loader->failed)
+            pthread_cond_wait (&loader->ready, &loader->lock);
+          result = loader->failed;
+          loader->consumed = i+1;
+          pthread_cond_broadcast (&loader->space);
+          pthread_mutex_unlock (&loader->lock);
+        }
+
+      if (!result && func (file, data))
+        result = -1;
+      free (file->value);
+      file->value = NULL;
+    }
+
+  if (n_started)
+    {
+      pthread_mutex_lock (&loader->lock);
+      if (result)
+        loader->failed = 1;
+      pthread_cond_broadcast (&loader->space);
+      pthread_mutex_unlock (&loader->lock);
+      while (n_started > 0)
+        pthread_join (threads[--n_started], NULL);
+    }
+
+  for (; i < loader->n_files; i++)
+    free (loader->files[i].value);
+  return result;
+}
+
+/* the state of the window being loaded through the ring */
+struct RingWindow
+{
+  struct statx stx[LOADER_WINDOW];
+  int fds[LOADER_WINDOW];
+  size_t n_read[LOADER_WINDOW];
+  int results[LOADER_WINDOW];
+};
+
+static void
+_loader_ring_result (unsigned long long user_data, int res, void* data)
+{
+  struct RingWindow* window = data;
+  window->results[user_data] = res;
+}
+
+static void
+_loader_statx_to_stat (const struct statx* stx, struct stat* buf)
+{
+  memset (buf, '\0', sizeof (struct stat));
+  buf->st_dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+  buf->st_ino = stx->stx_ino;
+  buf->st_mode = stx->stx_mode;
+  buf->st_size = stx->stx_size;
+  buf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  buf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+/* waits for the n_queued requests, returns -1 if the ring failed */
+static int
+_loader_ring_flush (TdpkgRing* ring, struct RingWindow* window, int* n_queued)
+{
+  int n = *n_queued;
+  *n_queued = 0;
+  if (n && tdpkg_ring_wait (ring, n, _loader_ring_result, window))
+    {
+      fprintf (stderr, "tdpkg: can't wait for io_uring: %s\n", strerror (errno));
+      /* the files opened meanwhile are still closed */
+      tdpkg_ring_reap (ring, _loader_ring_result, window);
+      return -1;
+    }
+  return 0;
+}
+
+/* returns a request, after waiting for the queued ones if the submission
+   queue is full, or NULL if the ring failed */
+static struct io_uring_sqe*
+_loader_ring_sqe (TdpkgRing* ring, struct RingWindow* window, int* n_queued)
+{
+  struct io_uring_sqe* sqe = tdpkg_ring_get_sqe (ring);
+  if (!sqe && *n_queued && !_loader_ring_flush (ring, window, n_queued))
+    sqe = tdpkg_ring_get_sqe (ring);
+  if (!sqe)
+    {
+      fprintf (stderr, "tdpkg: io_uring submission queue full\n");
+      return NULL;
+    }
+  (*n_queued)++;
+  return sqe;
+}
+
+/* load n files starting from files, on failure no value nor fd is left */
+static int
+_loader_ring_window (struct Loader* loader, TdpkgRing* ring, struct RingWindow* window,
+                     TdpkgLoadedFile* files, int n)
+{
+  struct io_uring_sqe* sqe;
+  int n_queued = 0;
+  int failed = 0;
+  int result = 0;
+  int i;
+
+  for (i=0; i < n; i++)
+    window->fds[i] = -1;
+
+  for (i=0; i < n; i++)
+    {
+      if (!(sqe = _loader_ring_sqe (ring, window, &n_queued)))
+        return -1;
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t) files[i].filename;
+      sqe->len = STATX_BASIC_STATS;
+      sqe->off = (uintptr_t) &window->stx[i];
+      sqe->user_data = i;
+    }
+  if (_loader_ring_flush (ring, window, &n_queued))
+    return -1;
+
+  for (i=0; i < n; i++)
+    {
+      TdpkgLoadedFile* file = &files[i];
+      if (window->results[i] < 0)
+        {
+          if (window->results[i] == -ENOENT)
+            {
+              file->state = TDPKG_MISSING;
+              continue;
+            }
+          fprintf (stderr, "tdpkg: can't stat %s: %s\n", file->filename, strerror (-window->results[i]));
+          result = -1;
+          break;
+        }
+
+      _loader_statx_to_stat (&window->stx[i], &file->stat);
+      if (loader->check && loader->check (file->filename, &file->stat, loader->data))
+        {
+          file->state = TDPKG_UNCHANGED;
+          continue;
+        }
+
+      file->state = TDPKG_LOADED;
+      /* files not opened yet when the ring fails are told apart from the
+         opened ones to close */
+      window->results[i] = -ECANCELED;
+      if (!(sqe = _loader_ring_sqe (ring, window, &n_queued)))
+        {
+          failed = 1;
+          break;
+        }
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t) file->filename;
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+      sqe->user_data = i;
+    }
+  /* the files opened are waited for even if one couldn't be stat'ed */
+  int n_stated = i;
+  if (!failed && _loader_ring_flush (ring, window, &n_queued))
+    failed = 1;
+
+  for (i=0; i < n_stated; i++)
+    {
+      TdpkgLoadedFile* file = &files[i];
+      if (file->state != TDPKG_LOADED)
+        continue;
+      if (window->results[i] < 0)
+        {
+          /* removed after being stat'ed */
+          if (window->results[i] == -ENOENT)
+            file->state = TDPKG_MISSING;
+          else if (!failed)
+            {
+              fprintf (stderr, "tdpkg: can't open %s: %s\n", file->filename, strerror (-window->results[i]));
+              result = -1;
+            }
+          continue;
+        }
+      window->fds[i] = window->results[i];
+      window->n_read[i] = 0;
+      file->value = malloc (loader->offset + file->stat.st_size + 1);
+      file->value[loader->offset + file->stat.st_size] = '\0';
+    }
+  if (failed)
+    result = -1;
+
+  /* reads are queued again until every file is read in full */
+  while (!result)
+    {
+      for (i=0; i < n; i++)
+        {
+          if (window->fds[i] < 0 || window->n_read[i] == files[i].stat.st_size)
+            continue;
+          if (!(sqe = _loader_ring_sqe (ring, window, &n_queued)))
+            {
+              failed = 1;
+              break;
+            }
+          sqe->opcode = IORING_OP_READ;
+          sqe->fd = window->fds[i];
+          sqe->addr = (uintptr_t) (files[i].value + loader->offset + window->n_read[i]);
+          sqe->len = files[i].stat.st_size - window->n_read[i];
+          sqe->off = window->n_read[i];
+          sqe->user_data = i;
+        }
+      if (failed || !n_queued)
+        break;
+      if (_loader_ring_flush (ring, window, &n_queued))
+        {
+          failed = 1;
+          break;
+        }
+
+      for (i=0; i < n; i++)
+        {
+          if (window->fds[i] < 0 || window->n_read[i] == files[i].stat.st_size)
+            continue;
+          if (window->results[i] <= 0)
+            {
+              fprintf (stderr, "tdpkg: can't read full file %s of size %zu\n",
+                       files[i].filename, (size_t) files[i].stat.st_size);
+              result = -1;
+              break;
+            }
+          window->n_read[i] += window->results[i];
+        }
+    }
+
+  /* once the ring failed the fds left are closed without it */
+  if (!failed)
+    {
+      for (i=0; i < n; i++)
+        {
+          if (window->fds[i] < 0)
+            continue;
+          window->results[i] = 1;
+          if (!(sqe = _loader_ring_sqe (ring, window, &n_queued)))
+            break;
+          sqe->opcode = IORING_OP_CLOSE;
+          sqe->fd = window->fds[i];
+          sqe->user_data = i;
+        }
+      if (i < n || _loader_ring_flush (ring, window, &n_queued))
+        failed = 1;
+      for (i=0; i < n; i++)
+        if (window->fds[i] >= 0 && window->results[i] != 1)
+          window->fds[i] = -1;
+    }
+  for (i=0; i < n; i++)
+    if (window->fds[i] >= 0)
+      syscall (SYS_close, window->fds[i]);
+
+  if (failed)
+    result = -1;
+  if (result)
+    for (i=0; i < n; i++)
+      {
+        free (files[i].value);
+        files[i].value = NULL;
+      }
+  return result;
+}
+
+static int
+_loader_run_ring (struct Loader* loader, TdpkgRing* ring, TdpkgLoaderFunc func, void* data)
+{
+  struct RingWindow* window = malloc (sizeof (struct RingWindow));
+  int result = 0;
+  int start;
+  for (start=0; start < loader->n_files && !result; start += LOADER_WINDOW)
+    {
+      TdpkgLoadedFile* files = loader->files + start;
+      int n = loader->n_files - start;
+      if (n > LOADER_WINDOW)
+        n = LOADER_WINDOW;
+      if (_loader_ring_window (loader, ring, window, files, n))
+        {
+          result = -1;
+          break;
+        }
+
+      int i;
+      for (i=0; i < n; i++)
+        {
+          if (!result && func (&files[i], data))
+            result = -1;
+          free (files[i].value);
+          files[i].value = NULL;
+        }
+    }
+  free (window);
+  return result;
+}
+
+static int
+_loader_use_ring (TdpkgRing* ring)
+{
+  const char* uring = getenv ("TDPKG_IO_URING");
+  if (uring && !strcmp (uring, "0"))
+    return 0;
+  static const unsigned char opcodes[] = { IORING_OP_STATX, IORING_OP_OPENAT,
+                                           IORING_OP_READ, IORING_OP_CLOSE };
+  return !tdpkg_ring_init (ring, LOADER_WINDOW, opcodes, sizeof (opcodes));
+}
+
+struct ListedFile
+{
+  ino_t ino;
+  char* filename;
+};
+
+static int
+_loader_compare_ino (const void* a, const void* b)
+{
+  const struct ListedFile* fa = a;
+  const struct ListedFile* fb = b;
+  return fa->ino < fb->ino ? -1 : fa->ino > fb->ino;
+}
+
+static int
+_loader_has_suffix (const char* name, size_t len, const char* const* suffixes)
+{
+  int i;
+  for (i=0; suffixes[i]; i++)
+    {
+      size_t suffix_len = strlen (suffixes[i]);
+      if (len > suffix_len+1 && name[len-suffix_len-1] == '.'
+          && !strcmp (name + len - suffix_len, suffixes[i]))
+        return 1;
+    }
+  return 0;
+}
+
+/* inode numbers come for free with the directory entries, and file
+   systems lay out contents close to their inodes far more than by name */
+char**
+tdpkg_list_files (const char* dirname, const char* const* suffixes, int* n_filenames)
+{
+  DIR* dir = opendir (dirname);
+  if (!dir)
+    {
+      fprintf (stderr, "tdpkg: can't open %s: %s\n", dirname, strerror (errno));
+      return NULL;
+    }
+
+  size_t dir_len = strlen (dirname);
+  struct ListedFile* listed = NULL;
+  int n_listed = 0;
+  int n_alloc = 0;
+  struct dirent* entry;
+  while ((entry = readdir (dir)))
+    {
+      size_t len = strlen (entry->d_name);
+      if (entry->d_name[0] == '.' || !_loader_has_suffix (entry->d_name, len, suffixes))
+        continue;
+
+      if (n_listed == n_alloc)
+        {
+          n_alloc = n_alloc ? n_alloc*2 : 1024;
+          listed = realloc (listed, n_alloc * sizeof (struct ListedFile));
+        }
+      char* filename = malloc (dir_len + len + 2);
+      memcpy (filename, dirname, dir_len);
+      filename[dir_len] = '/';
+      memcpy (filename + dir_len + 1, entry->d_name, len+1);
+      listed[n_listed].ino = entry->d_ino;
+      listed[n_listed].filename = filename;
+      n_listed++;
+    }
+  closedir (dir);
+
+  qsort (listed, n_listed, sizeof (struct ListedFile), _loader_compare_ino);
+  char** filenames = malloc ((n_listed ? n_listed : 1) * sizeof (char*));
+  int i;
+  for (i=0; i < n_listed; i++)
+    filenames[i] = listed[i].filename;
+  free (listed);
+
+  *n_filenames = n_listed;
+  return filenames;
+}
+
+void
+tdpkg_free_files (char** filenames, int n_filenames)
+{
+  int i;
+  for (i=0; i < n_filenames; i++)
+    free (filenames[i]);
+  free (filenames);
+}
+
+/* returns 0 if every file has been loaded and consumed */
+int
+tdpkg_load_files (char** filenames, int n_filenames, size_t offset,
+                  TdpkgLoaderCheck check, TdpkgLoaderFunc func, void* data)
+{
+  struct Loader loader;
+  memset (&loader, '\0', sizeof (loader));
+  loader.offset = offset;
+  loader.check = check;
+  loader.data = data;
+  loader.n_files = n_filenames;
+  loader.files = calloc (n_filenames ? n_filenames : 1, sizeof (TdpkgLoadedFile));
+  loader.done = calloc (n_filenames ? n_filenames : 1, sizeof (char));
+  pthread_mutex_init (&loader.lock, NULL);
+  pthread_cond_init (&loader.ready, NULL);
+  pthread_cond_init (&loader.space, NULL);
+
+  int i;
+  for (i=0; i < n_filenames; i++)
+    loader.files[i].filename = filenames[i];
+
+  int result;
+  TdpkgRing ring;
+  if (n_filenames && _loader_use_ring (&ring))
+    {
+      result = _loader_run_ring (&loader, &ring, func, data);
+      tdpkg_ring_free (&ring);
+    }
+  else
+    result = _loader_run_threads (&loader, func, data);
+
+  free (loader.files);
+  free (loader.done);
+  pthread_mutex_destroy (&loader.lock);
+  pthread_cond_destroy (&loader.ready);
+  pthread_cond_destroy (&loader.space);
+  return result ? -1 : 0;
+}
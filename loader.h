@@ -0,0 +1,59 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+enum
+{
+  TDPKG_LOADED,
+  TDPKG_UNCHANGED,
+  TDPKG_MISSING
+};
+
+typedef struct
+{
+  const char* filename;
+  int state;
+  struct stat stat;
+  /* when loaded, the contents are stored at the offset passed to
+     tdpkg_load_files and followed by a '\0' */
+  char* value;
+} TdpkgLoadedFile;
+
+/* may be called by the loading threads, returns non-zero if filename doesn't
+   need to be read */
+typedef int (*TdpkgLoaderCheck) (const char* filename, const struct stat* buf, void* data);
+/* called in the calling thread in the order of filenames, value is
+   freed afterwards unless func takes it by setting it to NULL */
+typedef int (*TdpkgLoaderFunc) (TdpkgLoadedFile* file, void* data);
+
+/* returns the n_filenames paths of the files in dirname ending with '.'
+   and one of the NULL terminated suffixes, ordered by inode, or NULL on
+   error. Free them with tdpkg_free_files */
+char** tdpkg_list_files (const char* dirname, const char* const* suffixes, int* n_filenames);
+void tdpkg_free_files (char** filenames, int n_filenames);
+
+int tdpkg_load_files (char** filenames, int n_filenames, size_t offset,
+                      TdpkgLoaderCheck check, TdpkgLoaderFunc func, void* data);
+
+#endif
@@ -0,0 +1,447 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "owners.h"
+#include "backend.h"
+#include "util.h"
+
+/* OWNERS_KEY followed by the path holds the names of its packages, each
+   followed by a '\n' */
+#define OWNERS_KEY "tdpkg:owner:"
+/* present while the index matches the list files cached */
+#define OWNERS_INDEXED_KEY "tdpkg:owners"
+
+struct OwnersOp
+{
+  const char* package;
+  int add;
+};
+
+/* the packages added to and removed from a path, in order */
+struct OwnersChange
+{
+  char* path;
+  uint32_t hash;
+  struct OwnersOp* ops;
+  int n_ops;
+};
+
+/* a line of a list file */
+struct OwnersLine
+{
+  const char* line;
+  size_t len;
+  uint32_t hash;
+  int seen;
+};
+
+int tdpkg_owners_enabled = 0;
+
+static struct OwnersChange* changes = NULL;
+static uint32_t n_changes = 0;
+static uint32_t n_alloc = 0;
+static uint32_t* buckets = NULL;
+static uint32_t n_buckets = 0;
+static char** packages = NULL;
+static int n_packages = 0;
+
+void
+tdpkg_owners_initialize (void)
+{
+  char configured[16];
+  const char* owners = getenv ("TDPKG_OWNERS");
+  if ((!owners || !*owners) && !tdpkg_config ("owners", configured, sizeof (configured)))
+    owners = configured;
+  tdpkg_owners_enabled = owners && *owners && strcmp (owners, "0");
+}
+
+static void
+_owners_grow (void)
+{
+  uint32_t i;
+  n_buckets = n_buckets ? n_buckets*2 : 1024;
+  free (buckets);
+  buckets = malloc (n_buckets * sizeof (uint32_t));
+  memset (buckets, 0xff, n_buckets * sizeof (uint32_t));
+  uint32_t mask = n_buckets-1;
+  for (i=0; i < n_changes; i++)
+    {
+      uint32_t b = changes[i].hash & mask;
+      while (buckets[b] != UINT32_MAX)
+        b = (b+1) & mask;
+      buckets[b] = i;
+    }
+}
+
+static struct OwnersChange*
+_owners_change (const char* path, size_t len)
+{
+  if (n_changes*2 >= n_buckets)
+    _owners_grow ();
+
+  uint32_t hash = tdpkg_hash (path, len);
+  uint32_t mask = n_buckets-1;
+  uint32_t b;
+  for (b = hash & mask; buckets[b] != UINT32_MAX; b = (b+1) & mask)
+    {
+      struct OwnersChange* change = &changes[buckets[b]];
+      if (change->hash == hash && !strncmp (change->path, path, len) && !change->path[len])
+        return change;
+    }
+
+  if (n_changes == n_alloc)
+    {
+      n_alloc = n_alloc ? n_alloc*2 : 1024;
+      changes = realloc (changes, n_alloc * sizeof (struct OwnersChange));
+    }
+  buckets[b] = n_changes;
+  struct OwnersChange* change = &changes[n_changes++];
+  change->path = strndup (path, len);
+  change->hash = hash;
+  change->ops = NULL;
+  change->n_ops = 0;
+  return change;
+}
+
+static void
+_owners_op (const char* path, size_t len, const char* package, int add)
+{
+  struct OwnersChange* change = _owners_change (path, len);
+  change->ops = realloc (change->ops, (change->n_ops+1) * sizeof (struct OwnersOp));
+  change->ops[change->n_ops].package = package;
+  change->ops[change->n_ops].add = add;
+  change->n_ops++;
+}
+
+/* lines of contents, with a table of n_buckets to look them up */
+static struct OwnersLine*
+_owners_lines (const char* contents, size_t len, int* n_lines)
+{
+  struct OwnersLine* lines = NULL;
+  int n = 0, alloc = 0;
+  const char* end = contents + len;
+  const char* line = contents;
+  while (line < end)
+    {
+      const char* eol = memchr (line, '\n', end-line);
+      if (!eol)
+        eol = end;
+      if (eol > line)
+        {
+          if (n == alloc)
+            {
+              alloc = alloc ? alloc*2 : 256;
+              lines = realloc (lines, alloc * sizeof (struct OwnersLine));
+            }
+          lines[n].line = line;
+          lines[n].len = eol-line;
+          lines[n].hash = tdpkg_hash (line, eol-line);
+          lines[n].seen = 0;
+          n++;
+        }
+      line = eol+1;
+    }
+  *n_lines = n;
+  return lines;
+}
+
+/* only the paths whose owners change are touched */
+void
+tdpkg_owners_update (const char* package, const char* old_contents, size_t old_len,
+                     const char* new_contents, size_t new_len)
+{
+  packages = realloc (packages, (n_packages+1) * sizeof (char*));
+  char* name = strdup (package);
+  packages[n_packages++] = name;
+
+  int n_old = 0, n_new = 0;
+  struct OwnersLine* old_lines = old_contents ? _owners_lines (old_contents, old_len, &n_old) : NULL;
+  struct OwnersLine* new_lines = new_contents ? _owners_lines (new_contents, new_len, &n_new) : NULL;
+
+  uint32_t n_old_buckets = 16;
+  while (n_old_buckets < (uint32_t) n_old*2)
+    n_old_buckets <<= 1;
+  int* old_buckets = malloc (n_old_buckets * sizeof (int));
+  memset (old_buckets, 0xff, n_old_buckets * sizeof (int));
+  uint32_t mask = n_old_buckets-1;
+  int i;
+  for (i=0; i < n_old; i++)
+    {
+      uint32_t b = old_lines[i].hash & mask;
+      while (old_buckets[b] >= 0)
+        b = (b+1) & mask;
+      old_buckets[b] = i;
+    }
+
+  for (i=0; i < n_new; i++)
+    {
+      struct OwnersLine* line = &new_lines[i];
+      struct OwnersLine* old = NULL;
+      uint32_t b;
+      for (b = line->hash & mask; old_buckets[b] >= 0; b = (b+1) & mask)
+        {
+          struct OwnersLine* candidate = &old_lines[old_buckets[b]];
+          if (candidate->len == line->len && !memcmp (candidate->line, line->line, line->len))
+            {
+              old = candidate;
+              break;
+            }
+        }
+      if (old)
+        old->seen = 1;
+      else
+        _owners_op (line->line, line->len, name, 1);
+    }
+  for (i=0; i < n_old; i++)
+    if (!old_lines[i].seen)
+      _owners_op (old_lines[i].line, old_lines[i].len, name, 0);
+
+  free (old_buckets);
+  free (old_lines);
+  free (new_lines);
+}
+
+static char*
+_owners_key (const char* path)
+{
+  char* key = malloc (strlen (OWNERS_KEY) + strlen (path) + 1);
+  sprintf (key, "%s%s", OWNERS_KEY, path);
+  return key;
+}
+
+/* the names a path is owned by while applying changes, with a table of
+   n_buckets to look them up. Names removed are only flagged, so that
+   buckets never have to be removed */
+struct OwnersNames
+{
+  const char** names;
+  size_t* lens;
+  uint32_t* hashes;
+  char* removed;
+  int n;
+  int alloc;
+  int* buckets;
+  uint32_t n_buckets;
+};
+
+static void
+_owners_names_grow (struct OwnersNames* names)
+{
+  int i;
+  names->n_buckets = names->n_buckets ? names->n_buckets*2 : 16;
+  free (names->buckets);
+  names->buckets = malloc (names->n_buckets * sizeof (int));
+  memset (names->buckets, 0xff, names->n_buckets * sizeof (int));
+  uint32_t mask = names->n_buckets-1;
+  for (i=0; i < names->n; i++)
+    {
+      uint32_t b = names->hashes[i] & mask;
+      while (names->buckets[b] >= 0)
+        b = (b+1) & mask;
+      names->buckets[b] = i;
+    }
+}
+
+static void
+_owners_set (struct OwnersNames* names, const char* name, size_t len, int add)
+{
+  if ((uint32_t) names->n*2 >= names->n_buckets)
+    _owners_names_grow (names);
+
+  uint32_t hash = tdpkg_hash (name, len);
+  uint32_t mask = names->n_buckets-1;
+  uint32_t b;
+  for (b = hash & mask; names->buckets[b] >= 0; b = (b+1) & mask)
+    {
+      int i = names->buckets[b];
+      if (names->hashes[i] == hash && names->lens[i] == len && !memcmp (names->names[i], name, len))
+        {
+          names->removed[i] = !add;
+          return;
+        }
+    }
+  if (!add)
+    return;
+
+  if (names->n == names->alloc)
+    {
+      names->alloc = names->alloc ? names->alloc*2 : 8;
+      names->names = realloc (names->names, names->alloc * sizeof (char*));
+      names->lens = realloc (names->lens, names->alloc * sizeof (size_t));
+      names->hashes = realloc (names->hashes, names->alloc * sizeof (uint32_t));
+      names->removed = realloc (names->removed, names->alloc * sizeof (char));
+    }
+  names->buckets[b] = names->n;
+  names->names[names->n] = name;
+  names->lens[names->n] = len;
+  names->hashes[names->n] = hash;
+  names->removed[names->n] = 0;
+  names->n++;
+}
+
+/* applies the ops of change to the names stored, returns the new value
+   or NULL if nobody owns the path anymore */
+static char*
+_owners_apply (struct OwnersChange* change, const char* stored, size_t stored_len, size_t* len)
+{
+  struct OwnersNames names;
+  memset (&names, '\0', sizeof (names));
+  const char* end = stored + stored_len;
+  const char* name = stored;
+  while (name < end)
+    {
+      const char* eol = memchr (name, '\n', end-name);
+      if (!eol)
+        eol = end;
+      if (eol > name)
+        _owners_set (&names, name, eol-name, 1);
+      name = eol+1;
+    }
+
+  int i;
+  for (i=0; i < change->n_ops; i++)
+    _owners_set (&names, change->ops[i].package, strlen (change->ops[i].package), change->ops[i].add);
+
+  char* value = NULL;
+  *len = 0;
+  for (i=0; i < names.n; i++)
+    if (!names.removed[i])
+      *len += names.lens[i] + 1;
+  if (*len)
+    {
+      value = malloc (*len);
+      char* pos = value;
+      for (i=0; i < names.n; i++)
+        {
+          if (names.removed[i])
+            continue;
+          memcpy (pos, names.names[i], names.lens[i]);
+          pos[names.lens[i]] = '\n';
+          pos += names.lens[i] + 1;
+        }
+    }
+  free (names.names);
+  free (names.lens);
+  free (names.hashes);
+  free (names.removed);
+  free (names.buckets);
+  return value;
+}
+
+int
+tdpkg_owners_flush (int replace)
+{
+  uint32_t i;
+  for (i=0; i < n_changes; i++)
+    {
+      struct OwnersChange* change = &changes[i];
+      char* key = _owners_key (change->path);
+      size_t stored_len = 0;
+      const char* stored = replace ? NULL : tdpkg_backend_get (key, &stored_len);
+
+      size_t len;
+      char* value = _owners_apply (change, stored ? stored : "", stored_len, &len);
+      int result = 0;
+      if (value)
+        result = tdpkg_backend_put (key, value, len);
+      else if (stored)
+        result = tdpkg_backend_delete (key);
+      if (stored)
+        tdpkg_backend_release (stored);
+      free (value);
+      free (key);
+      if (result)
+        {
+          tdpkg_owners_reset ();
+          return -1;
+        }
+    }
+  tdpkg_owners_reset ();
+  return 0;
+}
+
+void
+tdpkg_owners_reset (void)
+{
+  uint32_t i;
+  for (i=0; i < n_changes; i++)
+    {
+      free (changes[i].path);
+      free (changes[i].ops);
+    }
+  free (changes);
+  free (buckets);
+  changes = NULL;
+  buckets = NULL;
+  n_changes = n_alloc = n_buckets = 0;
+
+  int j;
+  for (j=0; j < n_packages; j++)
+    free (packages[j]);
+  free (packages);
+  packages = NULL;
+  n_packages = 0;
+}
+
+int
+tdpkg_owners_is_indexed (void)
+{
+  size_t len;
+  const char* value = tdpkg_backend_get (OWNERS_INDEXED_KEY, &len);
+  if (!value)
+    return 0;
+  tdpkg_backend_release (value);
+  return 1;
+}
+
+int
+tdpkg_owners_mark (int indexed)
+{
+  if (indexed)
+    return tdpkg_backend_put (OWNERS_INDEXED_KEY, "1", 1);
+  return tdpkg_backend_delete (OWNERS_INDEXED_KEY);
+}
+
+int
+tdpkg_owners_is_key (const char* key)
+{
+  return !strncmp (key, OWNERS_KEY, strlen (OWNERS_KEY));
+}
+
+char*
+tdpkg_owners_lookup (const char* path)
+{
+  char* key = _owners_key (path);
+  size_t len;
+  const char* value = tdpkg_backend_get (key, &len);
+  free (key);
+  if (!value)
+    return NULL;
+
+  char* owners = malloc (len + 1);
+  memcpy (owners, value, len);
+  owners[len] = '\0';
+  tdpkg_backend_release (value);
+  return owners;
+}
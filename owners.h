@@ -0,0 +1,52 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OWNERS_H
+#define OWNERS_H
+
+#include <stddef.h>
+
+/* Reverse index of list files: for each path listed, the packages whose
+   list file holds it. It lives in the backend next to the entries and
+   is kept up to date by writers when TDPKG_OWNERS=1, otherwise the
+   first change to a list file marks it out of date. Changes are gathered
+   in memory and stored by flush before the batch is committed. */
+
+extern int tdpkg_owners_enabled;
+
+void tdpkg_owners_initialize (void);
+/* contents of the list file of package before and after it changed,
+   either may be NULL */
+void tdpkg_owners_update (const char* package, const char* old_contents, size_t old_len,
+                          const char* new_contents, size_t new_len);
+/* stores the changes since the last flush, when replace is set the
+   owners stored before are ignored */
+int tdpkg_owners_flush (int replace);
+/* forgets about the changes not stored */
+void tdpkg_owners_reset (void);
+/* returns 1 if the index matches the list files cached */
+int tdpkg_owners_is_indexed (void);
+/* marks the index as complete, or as out of date */
+int tdpkg_owners_mark (int indexed);
+/* returns 1 if key is part of the index */
+int tdpkg_owners_is_key (const char* key);
+/* the packages owning path, a line each, newly allocated, NULL if none */
+char* tdpkg_owners_lookup (const char* path);
+
+#endif
@@ -0,0 +1,402 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "paths.h"
+#include "backend.h"
+#include "util.h"
+
+/* Nodes are stored PATHS_CHUNK at a time under PATHS_KEY, so that adding
+   a few of them only rewrites the last chunk. Each node is its uint32
+   parent, its uint16 name length and the name. Node 0 is the root and
+   isn't stored. An encoded entry is the uint32 number of lines followed
+   by the node id of each line, or PATHS_VERBATIM followed by the
+   contents. */
+#define PATHS_CHUNK 4096
+#define PATHS_KEY "tdpkg:paths:%u"
+#define PATHS_VERBATIM UINT32_MAX
+
+struct PathNode
+{
+  uint32_t parent;
+  uint32_t name;
+  uint32_t name_len;
+  /* length of the whole path */
+  uint32_t path_len;
+};
+
+static int loaded = 0;
+/* the backend generation the nodes have been loaded from, they're loaded
+   again once the backend may serve another cache */
+static unsigned int loaded_generation = 0;
+static struct PathNode* nodes = NULL;
+static uint32_t n_nodes = 0;
+static uint32_t n_alloc = 0;
+static uint32_t n_stored = 0;
+static char* names = NULL;
+static size_t names_len = 0;
+static size_t names_alloc = 0;
+static uint32_t* buckets = NULL;
+static uint32_t n_buckets = 0;
+
+static uint32_t
+_paths_hash (uint32_t parent, const char* name, size_t len)
+{
+  return tdpkg_hash (name, len) ^ (parent * 0x9e3779b1u);
+}
+
+static void
+_paths_index (uint32_t id)
+{
+  struct PathNode* node = &nodes[id];
+  uint32_t mask = n_buckets-1;
+  uint32_t b = _paths_hash (node->parent, names + node->name, node->name_len) & mask;
+  while (buckets[b])
+    b = (b+1) & mask;
+  buckets[b] = id;
+}
+
+static uint32_t
+_paths_lookup (uint32_t parent, const char* name, size_t len)
+{
+  if (!n_buckets)
+    return 0;
+
+  uint32_t mask = n_buckets-1;
+  uint32_t b = _paths_hash (parent, name, len) & mask;
+  for (; buckets[b]; b = (b+1) & mask)
+    {
+      struct PathNode* node = &nodes[buckets[b]];
+      if (node->parent == parent && node->name_len == len && !memcmp (names + node->name, name, len))
+        return buckets[b];
+    }
+  return 0;
+}
+
+static uint32_t
+_paths_add (uint32_t parent, const char* name, size_t len)
+{
+  if (n_nodes == n_alloc)
+    {
+      n_alloc = n_alloc ? n_alloc*2 : 4096;
+      nodes = realloc (nodes, n_alloc * sizeof (struct PathNode));
+    }
+  if (names_len + len > names_alloc)
+    {
+      while (names_len + len > names_alloc)
+        names_alloc = names_alloc ? names_alloc*2 : 65536;
+      names = realloc (names, names_alloc);
+    }
+
+  uint32_t id = n_nodes++;
+  struct PathNode* node = &nodes[id];
+  node->parent = parent;
+  node->name = names_len;
+  node->name_len = len;
+  node->path_len = nodes[parent].path_len + 1 + len;
+  memcpy (names + names_len, name, len);
+  names_len += len;
+
+  /* buckets are at most half full, 0 is free as the root is never
+     indexed */
+  if (n_nodes*2 > n_buckets)
+    {
+      free (buckets);
+      n_buckets = n_buckets ? n_buckets*2 : 8192;
+      buckets = calloc (n_buckets, sizeof (uint32_t));
+      uint32_t i;
+      for (i=1; i < n_nodes; i++)
+        _paths_index (i);
+    }
+  else
+    _paths_index (id);
+  return id;
+}
+
+static int
+_paths_load_chunk (const char* value, size_t len)
+{
+  size_t pos = 0;
+  while (pos < len)
+    {
+      uint32_t parent;
+      uint16_t name_len;
+      if (len - pos < sizeof (parent) + sizeof (name_len))
+        return -1;
+      memcpy (&parent, value+pos, sizeof (parent));
+      memcpy (&name_len, value+pos+sizeof (parent), sizeof (name_len));
+      pos += sizeof (parent) + sizeof (name_len);
+      if (parent >= n_nodes || !name_len || len - pos < name_len)
+        return -1;
+      _paths_add (parent, value+pos, name_len);
+      pos += name_len;
+    }
+  return 0;
+}
+
+static int
+_paths_load (void)
+{
+  /* nodes added since the last flush belong to the batch going on */
+  if (loaded && (loaded_generation == tdpkg_backend_generation () || n_stored != n_nodes))
+    return 0;
+
+  tdpkg_paths_reset ();
+  /* the root */
+  n_nodes = 1;
+  n_alloc = 4096;
+  nodes = calloc (n_alloc, sizeof (struct PathNode));
+
+  uint32_t chunk;
+  for (chunk=0;; chunk++)
+    {
+      char key[32];
+      snprintf (key, sizeof (key), PATHS_KEY, chunk);
+      size_t len;
+      const char* value = tdpkg_backend_get (key, &len);
+      if (!value)
+        break;
+
+      int result = _paths_load_chunk (value, len);
+      tdpkg_backend_release (value);
+      if (result || n_nodes-1 > (chunk+1) * PATHS_CHUNK)
+        {
+          fprintf (stderr, "tdpkg: interned paths are corrupted\n");
+          tdpkg_paths_reset ();
+          return -1;
+        }
+      if (n_nodes-1 < (chunk+1) * PATHS_CHUNK)
+        break;
+    }
+
+  n_stored = n_nodes;
+  loaded = 1;
+  loaded_generation = tdpkg_backend_generation ();
+  return 0;
+}
+
+/* every line must be an absolute path without empty components */
+static int
+_paths_internable (const char* contents, size_t len, uint32_t* n_lines)
+{
+  *n_lines = 0;
+  if (len && contents[len-1] != '\n')
+    return 0;
+
+  const char* line = contents;
+  const char* end = contents+len;
+  while (line < end)
+    {
+      const char* eol = memchr (line, '\n', end-line);
+      if (*line != '/' || eol-line < 2 || eol[-1] == '/' || memchr (line, '\0', eol-line))
+        return 0;
+
+      const char* p;
+      const char* component = line+1;
+      for (p=line+1; p <= eol; p++)
+        if (p == eol || *p == '/')
+          {
+            if (p == component || p-component > UINT16_MAX)
+              return 0;
+            component = p+1;
+          }
+
+      (*n_lines)++;
+      line = eol+1;
+    }
+  return 1;
+}
+
+char*
+tdpkg_paths_encode (const char* contents, size_t len, size_t offset, size_t* encoded_len)
+{
+  uint32_t n_lines;
+  if (!_paths_internable (contents, len, &n_lines) || _paths_load ())
+    {
+      char* value = malloc (offset + sizeof (uint32_t) + len);
+      uint32_t verbatim = PATHS_VERBATIM;
+      memcpy (value+offset, &verbatim, sizeof (verbatim));
+      memcpy (value+offset+sizeof (verbatim), contents, len);
+      *encoded_len = sizeof (verbatim) + len;
+      return value;
+    }
+
+  *encoded_len = sizeof (uint32_t) * (1+n_lines);
+  char* value = malloc (offset + *encoded_len);
+  memcpy (value+offset, &n_lines, sizeof (n_lines));
+
+  char* ids = value + offset + sizeof (uint32_t);
+  const char* line = contents;
+  uint32_t i;
+  for (i=0; i < n_lines; i++)
+    {
+      const char* eol = memchr (line, '\n', contents+len-line);
+      uint32_t id = 0;
+      const char* component = line+1;
+      while (component < eol)
+        {
+          const char* slash = memchr (component, '/', eol-component);
+          if (!slash)
+            slash = eol;
+          uint32_t child = _paths_lookup (id, component, slash-component);
+          id = child ? child : _paths_add (id, component, slash-component);
+          component = slash+1;
+        }
+      memcpy (ids + i*sizeof (uint32_t), &id, sizeof (id));
+      line = eol+1;
+    }
+  return value;
+}
+
+/* returns -1 if an id is not a node loaded */
+static int
+_paths_expanded_len (const char* ids, uint32_t n_lines, size_t* total)
+{
+  *total = 0;
+  uint32_t i;
+  for (i=0; i < n_lines; i++)
+    {
+      uint32_t id;
+      memcpy (&id, ids + i*sizeof (uint32_t), sizeof (id));
+      if (!id || id >= n_nodes)
+        return -1;
+      *total += nodes[id].path_len + 1;
+    }
+  return 0;
+}
+
+char*
+tdpkg_paths_expand (const char* value, size_t len, size_t offset, size_t* expanded_len)
+{
+  uint32_t n_lines;
+  if (len < sizeof (n_lines))
+    return NULL;
+  memcpy (&n_lines, value, sizeof (n_lines));
+  value += sizeof (n_lines);
+  len -= sizeof (n_lines);
+
+  if (n_lines == PATHS_VERBATIM)
+    {
+      char* contents = malloc (offset + len + 1);
+      memcpy (contents+offset, value, len);
+      contents[offset+len] = '\0';
+      *expanded_len = len;
+      return contents;
+    }
+
+  if (len / sizeof (uint32_t) != n_lines || _paths_load ())
+    return NULL;
+
+  size_t total;
+  if (_paths_expanded_len (value, n_lines, &total))
+    {
+      /* nodes committed by another process since they were loaded show
+         up along with its entries when the backend reads the cache in
+         place. Not while nodes added by the batch going on aren't
+         flushed yet, they'd be lost */
+      if (n_stored != n_nodes)
+        return NULL;
+      tdpkg_paths_reset ();
+      if (_paths_load () || _paths_expanded_len (value, n_lines, &total))
+        return NULL;
+    }
+
+  char* contents = malloc (offset + total + 1);
+  char* line = contents+offset;
+  uint32_t i;
+  for (i=0; i < n_lines; i++)
+    {
+      uint32_t id;
+      memcpy (&id, value + i*sizeof (uint32_t), sizeof (id));
+
+      /* components are written from the last one */
+      size_t path_len = nodes[id].path_len;
+      char* end = line + path_len;
+      *end = '\n';
+      for (; id; id = nodes[id].parent)
+        {
+          end -= nodes[id].name_len;
+          memcpy (end, names + nodes[id].name, nodes[id].name_len);
+          *--end = '/';
+        }
+      line += path_len + 1;
+    }
+  contents[offset+total] = '\0';
+  *expanded_len = total;
+  return contents;
+}
+
+int
+tdpkg_paths_flush (void)
+{
+  if (!loaded || n_stored == n_nodes)
+    return 0;
+
+  uint32_t chunk;
+  for (chunk = (n_stored-1) / PATHS_CHUNK; chunk <= (n_nodes-2) / PATHS_CHUNK; chunk++)
+    {
+      uint32_t first = 1 + chunk*PATHS_CHUNK;
+      uint32_t last = first + PATHS_CHUNK;
+      if (last > n_nodes)
+        last = n_nodes;
+
+      size_t len = 0;
+      uint32_t id;
+      for (id=first; id < last; id++)
+        len += sizeof (uint32_t) + sizeof (uint16_t) + nodes[id].name_len;
+      char* value = malloc (len);
+      char* pos = value;
+      for (id=first; id < last; id++)
+        {
+          uint16_t name_len = nodes[id].name_len;
+          memcpy (pos, &nodes[id].parent, sizeof (uint32_t));
+          memcpy (pos + sizeof (uint32_t), &name_len, sizeof (name_len));
+          memcpy (pos + sizeof (uint32_t) + sizeof (name_len), names + nodes[id].name, name_len);
+          pos += sizeof (uint32_t) + sizeof (name_len) + name_len;
+        }
+
+      char key[32];
+      snprintf (key, sizeof (key), PATHS_KEY, chunk);
+      int result = tdpkg_backend_put (key, value, len);
+      free (value);
+      if (result)
+        return -1;
+    }
+
+  n_stored = n_nodes;
+  return 0;
+}
+
+void
+tdpkg_paths_reset (void)
+{
+  free (nodes);
+  free (names);
+  free (buckets);
+  nodes = NULL;
+  names = NULL;
+  buckets = NULL;
+  n_nodes = n_alloc = n_stored = n_buckets = 0;
+  names_len = names_alloc = 0;
+  loaded = 0;
+}
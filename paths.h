@@ -0,0 +1,41 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PATHS_H
+#define PATHS_H
+
+#include <stddef.h>
+
+/* Interned paths: every path is a node made of its parent node and its
+   last component, so list files can be stored as arrays of node ids.
+   The nodes live in the backend next to the entries and are only ever
+   appended to. */
+
+/* returns a buffer with offset bytes left free followed by the encoded
+   contents, which are kept verbatim if they're not a list of paths */
+char* tdpkg_paths_encode (const char* contents, size_t len, size_t offset, size_t* encoded_len);
+/* returns a buffer with offset bytes left free followed by the expanded
+   contents and a '\0', or NULL if value can't be expanded */
+char* tdpkg_paths_expand (const char* value, size_t len, size_t offset, size_t* expanded_len);
+/* stores the nodes added since the last flush */
+int tdpkg_paths_flush (void);
+/* forgets about the nodes, they're loaded again when needed */
+void tdpkg_paths_reset (void);
+
+#endif
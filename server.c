@@ -0,0 +1,186 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "server.h"
+#include "util.h"
+
+#define SERVER_MAGIC 0x31535444 /* TDS1 */
+/* a client gives up waiting for tdpkgd after this and reads the cache
+   itself */
+#define SERVER_TIMEOUT_MS 1000
+
+struct ServerRequest
+{
+  uint32_t magic;
+  char backend[28];
+};
+
+struct ServerReply
+{
+  uint32_t magic;
+  int32_t state;
+};
+
+static int
+_server_address (struct sockaddr_un* addr)
+{
+  char* path = tdpkg_admin_path (SERVER_SOCKET_NAME);
+  memset (addr, '\0', sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  int too_long = strlen (path) >= sizeof (addr->sun_path);
+  if (!too_long)
+    strcpy (addr->sun_path, path);
+  free (path);
+  return too_long ? -1 : 0;
+}
+
+int
+tdpkg_server_query (const char* backend, int* fd)
+{
+  *fd = -1;
+  struct sockaddr_un addr;
+  if (_server_address (&addr))
+    return -1;
+
+  int sock = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  /* nobody listening is the common case */
+  if (connect (sock, (struct sockaddr*)&addr, sizeof (addr)))
+    {
+      close (sock);
+      return -1;
+    }
+
+  struct timeval timeout = { SERVER_TIMEOUT_MS / 1000, (SERVER_TIMEOUT_MS % 1000) * 1000 };
+  setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+  setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+  struct ServerRequest request;
+  memset (&request, '\0', sizeof (request));
+  request.magic = SERVER_MAGIC;
+  strncpy (request.backend, backend, sizeof (request.backend)-1);
+  if (send (sock, &request, sizeof (request), MSG_NOSIGNAL) != sizeof (request))
+    {
+      close (sock);
+      return -1;
+    }
+
+  struct ServerReply reply;
+  struct iovec iov = { &reply, sizeof (reply) };
+  char control[CMSG_SPACE (sizeof (int))];
+  struct msghdr msg;
+  memset (&msg, '\0', sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+  ssize_t n = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC);
+  close (sock);
+
+  struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR (&msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy (fd, CMSG_DATA (cmsg), sizeof (int));
+  if (n != sizeof (reply) || reply.magic != SERVER_MAGIC || reply.state == TDPKG_SERVED_OTHER)
+    {
+      if (*fd >= 0)
+        close (*fd);
+      *fd = -1;
+      return -1;
+    }
+  return reply.state;
+}
+
+int
+tdpkg_server_listen (void)
+{
+  struct sockaddr_un addr;
+  if (_server_address (&addr))
+    {
+      fprintf (stderr, "tdpkgd: the path of %s is too long\n", SERVER_SOCKET_NAME);
+      return -1;
+    }
+
+  int sock = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    {
+      fprintf (stderr, "tdpkgd: can't create socket: %s\n", strerror (errno));
+      return -1;
+    }
+  /* left behind by a tdpkgd that didn't exit cleanly */
+  unlink (addr.sun_path);
+  /* any user may read the cache */
+  if (bind (sock, (struct sockaddr*)&addr, sizeof (addr)) || chmod (addr.sun_path, 0666) || listen (sock, 64))
+    {
+      fprintf (stderr, "tdpkgd: can't listen on %s: %s\n", addr.sun_path, strerror (errno));
+      close (sock);
+      return -1;
+    }
+  return sock;
+}
+
+int
+tdpkg_server_receive (int client, const char* backend)
+{
+  struct ServerRequest request;
+  ssize_t n = recv (client, &request, sizeof (request), 0);
+  if (n != sizeof (request) || request.magic != SERVER_MAGIC)
+    return -1;
+  request.backend[sizeof (request.backend)-1] = '\0';
+  return strcmp (request.backend, backend) ? 1 : 0;
+}
+
+int
+tdpkg_server_reply (int client, int state, int fd)
+{
+  struct ServerReply reply;
+  reply.magic = SERVER_MAGIC;
+  reply.state = state;
+  struct iovec iov = { &reply, sizeof (reply) };
+  char control[CMSG_SPACE (sizeof (int))];
+  struct msghdr msg;
+  memset (&msg, '\0', sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0)
+    {
+      memset (control, '\0', sizeof (control));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof (control);
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR (&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+      memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+    }
+  if (sendmsg (client, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof (reply))
+    return -1;
+  return 0;
+}
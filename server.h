@@ -0,0 +1,52 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+/* tdpkgd checks and rebuilds the cache on behalf of every process, which
+   asks it over SERVER_SOCKET_NAME in the admin directory whether the
+   cache is in sync. Backends that can read the cache from a file
+   descriptor are handed one, so that processes in a chroot sharing the
+   socket map the same cache. */
+#define SERVER_SOCKET_NAME "tdpkg.sock"
+
+enum
+{
+  /* the cache is in sync with the info directory */
+  TDPKG_SERVED_FRESH,
+  /* it's being rebuilt, list files have to be read from disk */
+  TDPKG_SERVED_STALE,
+  /* tdpkgd serves another backend */
+  TDPKG_SERVED_OTHER
+};
+
+/* asks tdpkgd about the cache of backend, returns -1 if it's not
+   running, otherwise the state and *fd is a read-only descriptor of the
+   cache or -1 */
+int tdpkg_server_query (const char* backend, int* fd);
+
+/* used by tdpkgd */
+int tdpkg_server_listen (void);
+/* reads the request of the client, returns 0 if it asks about backend */
+int tdpkg_server_receive (int client, const char* backend);
+/* fd is passed to the client when it's not -1 */
+int tdpkg_server_reply (int client, int state, int fd);
+
+#endif
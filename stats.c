@@ -0,0 +1,118 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "stats.h"
+#include "trace.h"
+
+uint64_t tdpkg_stats[TDPKG_N_STATS];
+int tdpkg_stats_enabled = 0;
+
+static const char* stat_names[TDPKG_N_STATS] =
+{
+  "opens", "hits", "misses", "fallbacks", "rebuilds", "bytes", "writes", "captures", "deletes"
+};
+
+static const char* timer_names[TDPKG_N_TIMERS] =
+{
+  "init", "freshness", "rebuild", "commit", "backend_open", "backend_get", "backend_put",
+  "backend_delete", "backend_begin", "backend_commit", "backend_foreach"
+};
+
+static uint64_t timer_ns[TDPKG_N_TIMERS];
+static uint64_t timer_calls[TDPKG_N_TIMERS];
+static uint64_t started = 0;
+
+static uint64_t
+_stats_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+tdpkg_stats_initialize (void)
+{
+  const char* report = getenv ("TDPKG_STATS");
+  tdpkg_stats_enabled = report && *report;
+  if (tdpkg_stats_enabled)
+    started = _stats_now ();
+}
+
+uint64_t
+tdpkg_stats_start (void)
+{
+  return tdpkg_stats_enabled || tdpkg_trace_enabled ? _stats_now () : 0;
+}
+
+void
+tdpkg_stats_stop (int timer, uint64_t start)
+{
+  if (!start)
+    return;
+  tdpkg_trace_stop (timer_names[timer], NULL, start);
+  if (!tdpkg_stats_enabled)
+    return;
+  timer_ns[timer] += _stats_now () - start;
+  timer_calls[timer]++;
+}
+
+/* the line is written at once, so that concurrent processes can append
+   to the same file */
+void
+tdpkg_stats_report (const char* backend)
+{
+  if (!tdpkg_stats_enabled)
+    return;
+
+  char* line = NULL;
+  size_t len = 0;
+  FILE* out = open_memstream (&line, &len);
+  if (!out)
+    return;
+  fprintf (out, "{\"pid\":%d,\"program\":\"%s\",\"backend\":\"%s\",\"elapsed_us\":%llu,\"counters\":{",
+           (int) getpid (), program_invocation_short_name, backend,
+           (unsigned long long) (_stats_now () - started) / 1000);
+  int i;
+  for (i=0; i < TDPKG_N_STATS; i++)
+    fprintf (out, "%s\"%s\":%llu", i ? "," : "", stat_names[i], (unsigned long long) tdpkg_stats[i]);
+  fprintf (out, "},\"timers\":{");
+  for (i=0; i < TDPKG_N_TIMERS; i++)
+    fprintf (out, "%s\"%s\":{\"calls\":%llu,\"us\":%llu}", i ? "," : "", timer_names[i],
+             (unsigned long long) timer_calls[i], (unsigned long long) timer_ns[i] / 1000);
+  fprintf (out, "}}\n");
+  fclose (out);
+
+  const char* report = getenv ("TDPKG_STATS");
+  int fd = open (report, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0 || write (fd, line, len) != (ssize_t) len)
+    fprintf (stderr, "tdpkg: can't write stats to %s: %s\n", report, strerror (errno));
+  if (fd >= 0)
+    close (fd);
+  free (line);
+}
@@ -0,0 +1,79 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/* Counters and timers of this process, written as a JSON line appended
+   to the file named by TDPKG_STATS when it exits. Counters are always
+   kept, timers only when TDPKG_STATS or TDPKG_TRACE is set. Neither is
+   thread safe, they're only updated by the thread that called into
+   tdpkg. */
+
+enum
+{
+  /* list files opened for reading */
+  TDPKG_STAT_OPENS,
+  TDPKG_STAT_HITS,
+  TDPKG_STAT_MISSES,
+  /* list files opened from disk after all */
+  TDPKG_STAT_FALLBACKS,
+  TDPKG_STAT_REBUILDS,
+  /* bytes read from the cache, or copied in memfds */
+  TDPKG_STAT_BYTES,
+  /* list files renamed into place, those whose contents were captured
+     and list files removed */
+  TDPKG_STAT_WRITES,
+  TDPKG_STAT_CAPTURES,
+  TDPKG_STAT_DELETES,
+  TDPKG_N_STATS
+};
+
+enum
+{
+  TDPKG_TIMER_INIT,
+  /* checking the stamp and the list files on lookup */
+  TDPKG_TIMER_FRESHNESS,
+  TDPKG_TIMER_REBUILD,
+  TDPKG_TIMER_COMMIT,
+  TDPKG_TIMER_BACKEND_OPEN,
+  TDPKG_TIMER_BACKEND_GET,
+  TDPKG_TIMER_BACKEND_PUT,
+  TDPKG_TIMER_BACKEND_DELETE,
+  TDPKG_TIMER_BACKEND_BEGIN,
+  TDPKG_TIMER_BACKEND_COMMIT,
+  TDPKG_TIMER_BACKEND_FOREACH,
+  TDPKG_N_TIMERS
+};
+
+extern uint64_t tdpkg_stats[TDPKG_N_STATS];
+extern int tdpkg_stats_enabled;
+
+#define TDPKG_STAT_ADD(stat, n) (tdpkg_stats[stat] += (n))
+
+void tdpkg_stats_initialize (void);
+/* returns 0 when timers are disabled, timed calls are also traced
+   when TDPKG_TRACE is set */
+uint64_t tdpkg_stats_start (void);
+void tdpkg_stats_stop (int timer, uint64_t start);
+void tdpkg_stats_report (const char* backend);
+
+#endif
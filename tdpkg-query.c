@@ -0,0 +1,120 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Answers which packages own a path from the index kept in the cache,
+   see owners.h, printing the same lines as dpkg -S. Only exact paths are
+   looked up, patterns and diversions are left to dpkg. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+static void
+_query_usage (void)
+{
+  fprintf (stderr, "usage: tdpkg-query [-S] path...\n");
+}
+
+/* prints the packages on a single line, comma separated */
+static void
+_query_print (FILE* out, char* owners, const char* path)
+{
+  char* name = owners;
+  char* eol;
+  while ((eol = strchr (name, '\n')))
+    {
+      *eol = '\0';
+      fprintf (out, "%s%s", name == owners ? "" : ", ", name);
+      name = eol+1;
+    }
+  fprintf (out, ": %s\n", path);
+}
+
+int
+main (int argc, char** argv)
+{
+  int first = 1;
+  if (argc > 1 && !strcmp (argv[1], "-S"))
+    first++;
+  if (first >= argc || argv[first][0] == '-')
+    {
+      _query_usage ();
+      return 2;
+    }
+
+  /* the cache prints its progress on stdout while indexing */
+  FILE* out = fdopen (dup (1), "w");
+  if (!out)
+    {
+      perror ("tdpkg-query");
+      return 2;
+    }
+  dup2 (2, 1);
+
+  setenv ("TDPKG_OWNERS", "1", 1);
+  if (tdpkg_cache_initialize ())
+    {
+      fprintf (stderr, "tdpkg-query: cache initialization failed\n");
+      return 2;
+    }
+
+  int result = 0;
+  int i;
+  for (i=first; i < argc; i++)
+    {
+      if (argv[i][0] != '/')
+        {
+          fprintf (stderr, "tdpkg-query: %s is not an absolute path, use dpkg -S for patterns\n", argv[i]);
+          result = 1;
+          continue;
+        }
+
+      /* like dpkg, trailing slashes are ignored */
+      char* path = strdup (argv[i]);
+      size_t len = strlen (path);
+      while (len > 1 && path[len-1] == '/')
+        path[--len] = '\0';
+
+      char* owners;
+      if (tdpkg_cache_owners (path, &owners))
+        {
+          fprintf (stderr, "tdpkg-query: the cache can't be queried, use dpkg -S\n");
+          free (path);
+          result = 2;
+          break;
+        }
+      if (owners)
+        _query_print (out, owners, path);
+      else
+        {
+          fprintf (stderr, "tdpkg-query: no path found matching %s\n", path);
+          result = 1;
+        }
+      free (owners);
+      free (path);
+    }
+
+  tdpkg_cache_finalize ();
+  fclose (out);
+  return result;
+}
@@ -24,34 +24,77 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #include "cache.h"
+#include "blocks.h"
+#include "util.h"
+#include "stats.h"
+#include "backend.h"
+#include "trace.h"
+
+extern void __chk_fail (void) __attribute__ ((__noreturn__));
 
 typedef int (*open_t)(const char *path, int oflag, ...);
 static int _tdpkg_open (const char *path, int oflag, int mode);
+static int vfile_claim (int fd);
 
 /* real functions */
 static open_t realopen;
 static open_t realopen64;
+static int (*realopenat)(int dirfd, const char *path, int oflag, ...);
+static int (*realopenat64)(int dirfd, const char *path, int oflag, ...);
 static int (*real__fxstat)(int ver, int fd, struct stat* buf);
 static int (*real__fxstat64)(int ver, int fd, struct stat64* buf);
+static int (*realfstat)(int fd, struct stat* buf);
+static int (*realfstat64)(int fd, struct stat64* buf);
+static int (*realfstatat)(int dirfd, const char *path, struct stat* buf, int flags);
+static int (*realfstatat64)(int dirfd, const char *path, struct stat64* buf, int flags);
+#ifdef STATX_TYPE
+static int (*realstatx)(int dirfd, const char *path, int flags, unsigned int mask, struct statx* buf);
+#endif
 static ssize_t (*realread)(int fildes, void *buf, size_t nbyte);
+static ssize_t (*realpread)(int fildes, void *buf, size_t nbyte, off_t offset);
+static ssize_t (*realpread64)(int fildes, void *buf, size_t nbyte, off64_t offset);
+static off_t (*reallseek)(int fildes, off_t offset, int whence);
+static off64_t (*reallseek64)(int fildes, off64_t offset, int whence);
+static int (*realdup)(int fildes);
+static int (*realdup2)(int fildes, int fildes2);
+static int (*realdup3)(int fildes, int fildes2, int flags);
 static int (*realclose)(int fd);
 static int (*realrename)(const char *old, const char *new);
 static int (*realunlink)(const char* pathname);
+static FILE* (*realfopen)(const char *path, const char *mode);
+static FILE* (*realfopen64)(const char *path, const char *mode);
+static int (*realfileno)(FILE* stream);
+static int (*realfileno_unlocked)(FILE* stream);
 
-/* handle open() of dpkg/src/filesdb.c */
-#define FAKE_FD 4321
-static struct OpenState
+/* handle open() of dpkg/src/filesdb.c
+   Every virtual file owns a real descriptor duplicated from an open
+   /dev/null, so its number can't collide with files opened by the
+   process. dup()'ed descriptors share the same VirtualFile and offset. */
+struct VirtualFile
 {
-  int fd;
-  char* contents;
+  int refs;
+  const char* contents;
   size_t len;
-  size_t read;
-  char *fn;
-} open_state;
+  off64_t offset;
+  /* set when contents are compressed, len is then the inflated length */
+  TdpkgBlocks* blocks;
+};
+
+static int placeholder_fd = -1;
+static struct VirtualFile** vfiles = NULL;
+static int n_vfiles = 0;
+
+/* TDPKG_MEMFD=1 serves list files as real memfd descriptors instead of
+   virtual files, TDPKG_MEMFD=sealed also seals them against writes */
+static int use_memfd;
+static int seal_memfd;
 
 static int cache_initialized;
 
@@ -76,43 +119,268 @@ void _init (void)
         }
     }
 
-  memset (&open_state, '\0', sizeof (open_state));
-  open_state.fd = -1;
-
   realopen = dlsym (RTLD_NEXT, "open");
   realopen64 = dlsym (RTLD_NEXT, "open64");
+  realopenat = dlsym (RTLD_NEXT, "openat");
+  realopenat64 = dlsym (RTLD_NEXT, "openat64");
+  /* glibc < 2.33 only exports the __fxstat family, newer ones export
+     fstat, fstat64 and fstatat directly */
   real__fxstat = dlsym (RTLD_NEXT, "__fxstat");
   real__fxstat64 = dlsym (RTLD_NEXT, "__fxstat64");
+  realfstat = dlsym (RTLD_NEXT, "fstat");
+  realfstat64 = dlsym (RTLD_NEXT, "fstat64");
+  realfstatat = dlsym (RTLD_NEXT, "fstatat");
+  realfstatat64 = dlsym (RTLD_NEXT, "fstatat64");
+#ifdef STATX_TYPE
+  realstatx = dlsym (RTLD_NEXT, "statx");
+#endif
   realread = dlsym (RTLD_NEXT, "read");
+  realpread = dlsym (RTLD_NEXT, "pread");
+  realpread64 = dlsym (RTLD_NEXT, "pread64");
+  reallseek = dlsym (RTLD_NEXT, "lseek");
+  reallseek64 = dlsym (RTLD_NEXT, "lseek64");
+  realdup = dlsym (RTLD_NEXT, "dup");
+  realdup2 = dlsym (RTLD_NEXT, "dup2");
+  realdup3 = dlsym (RTLD_NEXT, "dup3");
   realclose = dlsym (RTLD_NEXT, "close");
   realrename = dlsym (RTLD_NEXT, "rename");
   realunlink = dlsym (RTLD_NEXT, "unlink");
+  realfopen = dlsym (RTLD_NEXT, "fopen");
+  realfopen64 = dlsym (RTLD_NEXT, "fopen64");
+  realfileno = dlsym (RTLD_NEXT, "fileno");
+  realfileno_unlocked = dlsym (RTLD_NEXT, "fileno_unlocked");
+
+  char *memfd = getenv ("TDPKG_MEMFD");
+  if (memfd && *memfd && strcmp (memfd, "0"))
+    {
+      use_memfd = 1;
+      seal_memfd = !strcmp (memfd, "sealed");
+    }
 
+  placeholder_fd = realopen ("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (placeholder_fd < 0)
+    {
+      fprintf (stderr, "tdpkg: can't open /dev/null, no wrapping\n");
+      return;
+    }
+
+  tdpkg_stats_initialize ();
+  tdpkg_trace_initialize ();
+  uint64_t start = tdpkg_stats_start ();
   if (!tdpkg_cache_initialize ())
     cache_initialized = 1;
   else
     fprintf (stderr, "tdpkg: cache initialization failed, no wrapping\n");
+  tdpkg_stats_stop (TDPKG_TIMER_INIT, start);
+}
+
+/* called once the process exits */
+void _fini (void)
+{
+  if (cache_initialized)
+    tdpkg_cache_finalize ();
+  cache_initialized = 0;
+  tdpkg_stats_report (tdpkg_backend_name ());
+  tdpkg_trace_write ();
 }
 
+/* handle write_filelist_except() of dpkg/src/filesdb.c
+   List files are written with stdio to <pkg>.list-new and renamed in
+   place. Their stream goes through a cookie that also keeps a copy, so
+   the cache doesn't need to read them back after rename(). */
+struct CapturedFile
+{
+  char* path;
+  FILE* stream;
+  int fd;
+  int failed;
+  char* data;
+  size_t len;
+  size_t alloc;
+  struct CapturedFile* next;
+};
+
+static struct CapturedFile* captured = NULL;
+
+static struct CapturedFile*
+capture_lookup (const char* path, FILE* stream)
+{
+  struct CapturedFile* capture;
+  for (capture = captured; capture; capture = capture->next)
+    if ((path && !strcmp (capture->path, path)) || (stream && capture->stream == stream))
+      return capture;
+  return NULL;
+}
+
+static void
+capture_free (struct CapturedFile* capture)
+{
+  struct CapturedFile** link;
+  for (link = &captured; *link; link = &(*link)->next)
+    if (*link == capture)
+      {
+        *link = capture->next;
+        break;
+      }
+  free (capture->path);
+  free (capture->data);
+  free (capture);
+}
+
+static ssize_t
+capture_write (void* cookie, const char* buf, size_t size)
+{
+  struct CapturedFile* capture = cookie;
+  size_t written = 0;
+  while (written < size)
+    {
+      ssize_t n = write (capture->fd, buf+written, size-written);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        {
+          capture->failed = 1;
+          return written;
+        }
+      written += n;
+    }
+
+  if (capture->len + size > capture->alloc)
+    {
+      while (capture->len + size > capture->alloc)
+        capture->alloc = capture->alloc ? capture->alloc*2 : 65536;
+      capture->data = realloc (capture->data, capture->alloc);
+    }
+  memcpy (capture->data + capture->len, buf, size);
+  capture->len += size;
+  return size;
+}
+
+/* the copy is kept until the file is renamed */
 static int
-is_list_file (const char* path)
+capture_close (void* cookie)
 {
-  return strstr (path, "/var/lib/dpkg/info/") && strstr (path, ".list");
+  struct CapturedFile* capture = cookie;
+  int result = realclose (capture->fd);
+  if (result)
+    capture->failed = 1;
+  capture->fd = -1;
+  capture->stream = NULL;
+  return result;
+}
+
+/* only plain writes are captured, anything else goes to the real file */
+static FILE*
+capture_open (const char *path, const char *mode)
+{
+  if (!cache_initialized || !tdpkg_is_cached_new_file (path) || mode[0] != 'w' || strchr (mode, '+'))
+    return NULL;
+
+  int oflag = O_WRONLY | O_CREAT | O_TRUNC;
+  if (strchr (mode, 'e'))
+    oflag |= O_CLOEXEC;
+  if (strchr (mode, 'x'))
+    oflag |= O_EXCL;
+  int fd = vfile_claim (realopen (path, oflag, 0666));
+  if (fd < 0)
+    return NULL;
+
+  struct CapturedFile* capture = capture_lookup (path, NULL);
+  if (capture)
+    capture_free (capture);
+  capture = calloc (1, sizeof (struct CapturedFile));
+  capture->path = strdup (path);
+  capture->fd = fd;
+
+  cookie_io_functions_t functions = { NULL, capture_write, NULL, capture_close };
+  capture->stream = fopencookie (capture, "w", functions);
+  if (!capture->stream)
+    {
+      realclose (fd);
+      free (capture->path);
+      free (capture);
+      return NULL;
+    }
+  capture->next = captured;
+  captured = capture;
+  return capture->stream;
+}
+
+FILE*
+fopen (const char *path, const char *mode)
+{
+  FILE* stream = capture_open (path, mode);
+  if (stream)
+    return stream;
+  /* libraries may use stdio in their constructors, before _init */
+  if (!realfopen)
+    realfopen = dlsym (RTLD_NEXT, "fopen");
+  return realfopen (path, mode);
+}
+
+FILE*
+fopen64 (const char *path, const char *mode)
+{
+  FILE* stream = capture_open (path, mode);
+  if (stream)
+    return stream;
+  /* libraries may use stdio in their constructors, before _init */
+  if (!realfopen64)
+    realfopen64 = dlsym (RTLD_NEXT, "fopen64");
+  return realfopen64 (path, mode);
+}
+
+/* cookie streams have no descriptor of their own, dpkg fsync()s it */
+int
+fileno (FILE* stream)
+{
+  struct CapturedFile* capture = captured ? capture_lookup (NULL, stream) : NULL;
+  if (capture)
+    return capture->fd;
+  if (!realfileno)
+    realfileno = dlsym (RTLD_NEXT, "fileno");
+  return realfileno (stream);
+}
+
+int
+fileno_unlocked (FILE* stream)
+{
+  struct CapturedFile* capture = captured ? capture_lookup (NULL, stream) : NULL;
+  if (capture)
+    return capture->fd;
+  if (!realfileno_unlocked)
+    realfileno_unlocked = dlsym (RTLD_NEXT, "fileno_unlocked");
+  return realfileno_unlocked (stream);
 }
 
 int
 rename (const char *old, const char *new)
 {
   int result = realrename (old, new);
-  if (!result && is_list_file (new))
+  struct CapturedFile* capture = captured && !result ? capture_lookup (old, NULL) : NULL;
+  if (!result && tdpkg_is_cached_file (new))
     {
-      if (tdpkg_cache_write_filename (new))
+      int written;
+      TDPKG_PROBE2 (rename, old, new);
+      uint64_t start = tdpkg_trace_start ();
+      TDPKG_STAT_ADD (TDPKG_STAT_WRITES, 1);
+      if (capture && capture->fd < 0 && !capture->failed)
+        {
+          TDPKG_STAT_ADD (TDPKG_STAT_CAPTURES, 1);
+          written = tdpkg_cache_write_contents (new, capture->data, capture->len);
+        }
+      else
+        written = tdpkg_cache_write_filename (new);
+      tdpkg_trace_stop ("rename", new, start);
+      if (written)
         {
           fprintf (stderr, "tdpkg: can't update cache for file %s, no wrapping\n", new);
           tdpkg_cache_finalize ();
           cache_initialized = 0;
         }
     }
+  if (capture)
+    capture_free (capture);
   return result;
 }
 
@@ -120,9 +388,17 @@ int
 unlink (const char* pathname)
 {
   int result = realunlink (pathname);
-  if (!result && is_list_file (pathname))
+  struct CapturedFile* capture = captured && !result ? capture_lookup (pathname, NULL) : NULL;
+  if (capture)
+    capture_free (capture);
+  if (!result && tdpkg_is_cached_file (pathname))
     {
-      if (tdpkg_cache_delete_filename (pathname))
+      TDPKG_PROBE1 (unlink, pathname);
+      uint64_t start = tdpkg_trace_start ();
+      TDPKG_STAT_ADD (TDPKG_STAT_DELETES, 1);
+      int deleted = tdpkg_cache_delete_filename (pathname);
+      tdpkg_trace_stop ("unlink", pathname, start);
+      if (deleted)
         {
           fprintf (stderr, "tdpkg: can't delete %s from cache, no wrapping\n", pathname);
           tdpkg_cache_finalize ();
@@ -132,50 +408,307 @@ unlink (const char* pathname)
   return result;
 }
 
+static struct VirtualFile*
+vfile_lookup (int fd)
+{
+  if (fd < 0 || fd >= n_vfiles)
+    return NULL;
+  return vfiles[fd];
+}
+
+static void
+vfile_set (int fd, struct VirtualFile* vfile)
+{
+  if (fd >= n_vfiles)
+    {
+      int n = n_vfiles ? n_vfiles : 64;
+      while (n <= fd)
+        n *= 2;
+      vfiles = realloc (vfiles, n * sizeof (struct VirtualFile*));
+      memset (vfiles+n_vfiles, '\0', (n-n_vfiles) * sizeof (struct VirtualFile*));
+      n_vfiles = n;
+    }
+  vfiles[fd] = vfile;
+}
+
+static void
+blocks_free (TdpkgBlocks* blocks)
+{
+  if (!blocks)
+    return;
+  tdpkg_blocks_close (blocks);
+  free (blocks);
+}
+
+/* drop fd from the table, the real descriptor is left alone */
+static void
+vfile_forget (int fd)
+{
+  struct VirtualFile* vfile = vfile_lookup (fd);
+  if (!vfile)
+    return;
+
+  vfiles[fd] = NULL;
+  if (--vfile->refs > 0)
+    return;
+
+  blocks_free (vfile->blocks);
+  tdpkg_cache_release_filename (vfile->contents);
+  free (vfile);
+}
+
+/* a real descriptor with this number has just been handed out, so a
+   virtual file still registered there was closed behind our back */
 static int
-_tdpkg_open (const char *path, int oflag, int mode)
+vfile_claim (int fd)
 {
-  if (!cache_initialized)
-    return realopen (path, oflag, mode);
+  if (fd >= 0)
+    vfile_forget (fd);
+  return fd;
+}
 
-  if (!is_list_file (path) || (oflag & O_RDONLY) != O_RDONLY)
-    return realopen (path, oflag, mode);
+static off64_t
+vfile_seek (struct VirtualFile* vfile, off64_t offset, int whence)
+{
+  switch (whence)
+    {
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      offset += vfile->offset;
+      break;
+    case SEEK_END:
+      offset += vfile->len;
+      break;
+    default:
+      errno = EINVAL;
+      return -1;
+    }
 
-  // sometimes dpkg calls FIGETBSZ first time, open_state.fn fixes it
-  if (open_state.fd >= 0 && open_state.fn != path)
+  if (offset < 0)
     {
-#ifdef TDPKG_INFO
-      fprintf (stderr, "tdpkg: nested open(%s, %d, %d) detected, no wrapping\n", path, oflag, mode);
-#endif
-      return realopen (path, oflag, mode);
+      errno = EINVAL;
+      return -1;
     }
+  vfile->offset = offset;
+  return offset;
+}
+
+static void
+vfile_stat (struct VirtualFile* vfile, struct stat* buf)
+{
+  memset (buf, '\0', sizeof (struct stat));
+  buf->st_size = vfile->len;
+  buf->st_mode = S_IFREG;
+}
 
-  open_state.fn = (char*)path;
-  open_state.contents = tdpkg_cache_read_filename (path);
-  if (!open_state.contents)
+static void
+vfile_stat64 (struct VirtualFile* vfile, struct stat64* buf)
+{
+  memset (buf, '\0', sizeof (struct stat64));
+  buf->st_size = vfile->len;
+  buf->st_mode = S_IFREG;
+}
+
+/* fstatat(fd, "", buf, AT_EMPTY_PATH) is how fstat is spelled nowadays */
+static struct VirtualFile*
+vfile_lookup_at (int dirfd, const char *path, int flags)
+{
+  if (!(flags & AT_EMPTY_PATH) || !path || *path)
+    return NULL;
+  return vfile_lookup (dirfd);
+}
+
+static ssize_t
+vfile_pread (struct VirtualFile* vfile, void *buf, size_t nbyte, off64_t offset)
+{
+  TDPKG_PROBE2 (read, nbyte, offset);
+  if (offset < 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  if (vfile->blocks)
+    {
+      ssize_t nowread = tdpkg_blocks_pread (vfile->blocks, buf, nbyte, offset);
+      if (nowread > 0)
+        TDPKG_STAT_ADD (TDPKG_STAT_BYTES, nowread);
+      return nowread;
+    }
+
+  if (offset >= vfile->len)
+    return 0;
+
+  size_t nowread = (vfile->len-offset) > nbyte ? nbyte : (vfile->len-offset);
+  memcpy (buf, vfile->contents+offset, nowread);
+  TDPKG_STAT_ADD (TDPKG_STAT_BYTES, nowread);
+  return nowread;
+}
+
+/* copy contents into a fresh memfd, inflating them when blocks is set,
+   returns -1 if memfd can't be used */
+static int
+memfd_open (const char *path, int oflag, const char* contents, size_t len, TdpkgBlocks* blocks)
+{
+  char name[64];
+  const char* base = strrchr (path, '/');
+  snprintf (name, sizeof (name), "tdpkg:%s", base ? base+1 : path);
+
+  unsigned int flags = 0;
+  if (oflag & O_CLOEXEC)
+    flags |= MFD_CLOEXEC;
+  if (seal_memfd)
+    flags |= MFD_ALLOW_SEALING;
+
+  int fd = memfd_create (name, flags);
+  if (fd < 0)
+    return -1;
+  vfile_claim (fd);
+
+  /* pwrite keeps the offset at the start of the file */
+  char block[BLOCKS_SIZE];
+  size_t written = 0;
+  while (written < len)
+    {
+      const char* data = contents+written;
+      size_t data_len = len-written;
+      if (blocks)
+        {
+          ssize_t n = tdpkg_blocks_pread (blocks, block, sizeof (block), written);
+          if (n <= 0)
+            {
+              realclose (fd);
+              return -1;
+            }
+          data = block;
+          data_len = n;
+        }
+
+      ssize_t n = pwrite (fd, data, data_len, written);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        {
+          realclose (fd);
+          return -1;
+        }
+      written += n;
+    }
+
+  if (seal_memfd && fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL))
+    {
+      realclose (fd);
+      return -1;
+    }
+  return fd;
+}
+
+/* open a list file for reading from the cache */
+static int
+_tdpkg_open_list (const char *path, int oflag, int mode)
+{
+  TDPKG_STAT_ADD (TDPKG_STAT_OPENS, 1);
+  size_t len;
+  int compressed;
+  const char* contents = tdpkg_cache_borrow_filename (path, &len, &compressed);
+  TDPKG_STAT_ADD (contents ? TDPKG_STAT_HITS : TDPKG_STAT_MISSES, 1);
+  if (!contents)
     {
 #ifdef TDPKG_INFO
-      fprintf (stderr, "tdpkg: file %s not up-to-date in cache, rebuild cache\n", path);
+      fprintf (stderr, "tdpkg: file %s not up-to-date in cache, refresh cache\n", path);
 #endif
-      if (tdpkg_cache_rebuild ())
+      int result = tdpkg_cache_refresh_filename (path);
+      if (result < 0)
         {
-          fprintf (stderr, "tdpkg: can't rebuild cache, no wrapping\n");
+          fprintf (stderr, "tdpkg: can't refresh cache, no wrapping\n");
           tdpkg_cache_finalize ();
           cache_initialized = 0;
-          return realopen (path, oflag, mode);
+          TDPKG_STAT_ADD (TDPKG_STAT_FALLBACKS, 1);
+          return vfile_claim (realopen (path, oflag, mode));
+        }
+
+      /* the list file doesn't exist, let open() fail, or the cache is
+         being rebuilt in the background */
+      if (result > 0)
+        {
+          TDPKG_STAT_ADD (TDPKG_STAT_FALLBACKS, 1);
+          return vfile_claim (realopen (path, oflag, mode));
         }
 
-      open_state.contents = tdpkg_cache_read_filename (path);
-      if (!open_state.contents)
+      contents = tdpkg_cache_borrow_filename (path, &len, &compressed);
+      if (!contents)
         {
           fprintf (stderr, "tdpkg: path %s not being indexed, no wrapping\n", path);
-          return realopen (path, oflag, mode);
+          TDPKG_STAT_ADD (TDPKG_STAT_FALLBACKS, 1);
+          return vfile_claim (realopen (path, oflag, mode));
         }
     }
 
-  open_state.fd = FAKE_FD;
-  open_state.len = strlen (open_state.contents);
-  return open_state.fd;
+  TdpkgBlocks* blocks = NULL;
+  if (compressed)
+    {
+      blocks = malloc (sizeof (TdpkgBlocks));
+      if (tdpkg_blocks_open (blocks, contents, len))
+        {
+          fprintf (stderr, "tdpkg: corrupted cache entry for %s, no wrapping\n", path);
+          free (blocks);
+          tdpkg_cache_release_filename (contents);
+          TDPKG_STAT_ADD (TDPKG_STAT_FALLBACKS, 1);
+          return vfile_claim (realopen (path, oflag, mode));
+        }
+      len = blocks->len;
+    }
+
+  if (use_memfd)
+    {
+      int fd = memfd_open (path, oflag, contents, len, blocks);
+      if (fd >= 0)
+        {
+          TDPKG_STAT_ADD (TDPKG_STAT_BYTES, len);
+          blocks_free (blocks);
+          tdpkg_cache_release_filename (contents);
+          return fd;
+        }
+#ifdef TDPKG_INFO
+      fprintf (stderr, "tdpkg: can't create memfd for %s, using a virtual file\n", path);
+#endif
+    }
+
+  int fd = fcntl (placeholder_fd, (oflag & O_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+  if (fd < 0)
+    {
+      blocks_free (blocks);
+      tdpkg_cache_release_filename (contents);
+      return -1;
+    }
+  vfile_claim (fd);
+
+  struct VirtualFile* vfile = malloc (sizeof (struct VirtualFile));
+  vfile->refs = 1;
+  vfile->contents = contents;
+  vfile->len = len;
+  vfile->offset = 0;
+  vfile->blocks = blocks;
+  vfile_set (fd, vfile);
+  return fd;
+}
+
+static int
+_tdpkg_open (const char *path, int oflag, int mode)
+{
+  if (!cache_initialized)
+    return vfile_claim (realopen (path, oflag, mode));
+
+  if (!tdpkg_is_cached_file (path) || (oflag & O_ACCMODE) != O_RDONLY)
+    return vfile_claim (realopen (path, oflag, mode));
+
+  TDPKG_PROBE1 (open_entry, path);
+  uint64_t start = tdpkg_trace_start ();
+  int fd = _tdpkg_open_list (path, oflag, mode);
+  tdpkg_trace_stop ("open", path, start);
+  TDPKG_PROBE2 (open_return, path, fd);
+  return fd;
 }
 
 int
@@ -195,106 +728,299 @@ open64 (const char *path, int oflag, ...)
   va_start (ap, oflag);
   int mode = va_arg (ap, int);
   va_end (ap);
-  return _tdpkg_open (path, oflag, mode);
+  return _tdpkg_open (path, oflag | O_LARGEFILE, mode);
 }
 
-int
-__fxstat (int ver, int fd, struct stat* buf)
+/* resolve a path relative to dirfd, returns NULL if it can't be a cached file */
+static char*
+resolve_at (int dirfd, const char *path, char *buf, size_t size)
 {
-  if (!cache_initialized)
-    return real__fxstat (ver, fd, buf);
+  if (dirfd == AT_FDCWD || *path == '/')
+    return (char*)path;
+  if (!tdpkg_is_cached_name (path))
+    return NULL;
 
-  if (open_state.fd < 0)
-    return real__fxstat (ver, fd, buf);
+  char link[64];
+  snprintf (link, sizeof (link), "/proc/self/fd/%d", dirfd);
+  ssize_t len = readlink (link, buf, size-1);
+  if (len <= 0 || len + strlen (path) + 2 > size)
+    return NULL;
+  buf[len] = '/';
+  strcpy (buf+len+1, path);
+  return buf;
+}
 
-  if (open_state.fd != fd)
+static int
+_tdpkg_openat (int dirfd, const char *path, int oflag, int mode, int large)
+{
+  if (cache_initialized)
     {
-#ifdef TDPKG_INFO
-      fprintf (stderr, "tdpkg: nested __fxstat(%d) detected, no wrapping\n", fd);
-#endif
-      return real__fxstat (ver, fd, buf);
+      char buf[PATH_MAX];
+      const char *fullpath = resolve_at (dirfd, path, buf, sizeof (buf));
+      if (fullpath && tdpkg_is_cached_file (fullpath))
+        return _tdpkg_open (fullpath, oflag, mode);
     }
 
-  buf->st_size = open_state.len;
-  buf->st_mode = S_IFREG;
+  if (large)
+    return vfile_claim (realopenat64 (dirfd, path, oflag, mode));
+  return vfile_claim (realopenat (dirfd, path, oflag, mode));
+}
+
+int
+openat (int dirfd, const char *path, int oflag, ...)
+{
+  va_list ap;
+  va_start (ap, oflag);
+  int mode = va_arg (ap, int);
+  va_end (ap);
+  return _tdpkg_openat (dirfd, path, oflag, mode, 0);
+}
+
+int
+openat64 (int dirfd, const char *path, int oflag, ...)
+{
+  va_list ap;
+  va_start (ap, oflag);
+  int mode = va_arg (ap, int);
+  va_end (ap);
+  return _tdpkg_openat (dirfd, path, oflag, mode, 1);
+}
+
+/* _FORTIFY_SOURCE variants of open() without a mode */
+int
+__open_2 (const char *path, int oflag)
+{
+  return _tdpkg_open (path, oflag, 0);
+}
+
+int
+__open64_2 (const char *path, int oflag)
+{
+  return _tdpkg_open (path, oflag | O_LARGEFILE, 0);
+}
+
+int
+__openat_2 (int dirfd, const char *path, int oflag)
+{
+  return _tdpkg_openat (dirfd, path, oflag, 0, 0);
+}
+
+int
+__openat64_2 (int dirfd, const char *path, int oflag)
+{
+  return _tdpkg_openat (dirfd, path, oflag, 0, 1);
+}
+
+int
+__fxstat (int ver, int fd, struct stat* buf)
+{
+  struct VirtualFile* vfile = vfile_lookup (fd);
+  if (!vfile)
+    return real__fxstat (ver, fd, buf);
+
+  vfile_stat (vfile, buf);
   return 0;
 }
 
 int
 __fxstat64 (int ver, int fd, struct stat64* buf)
 {
-  if (!cache_initialized)
+  struct VirtualFile* vfile = vfile_lookup (fd);
+  if (!vfile)
     return real__fxstat64 (ver, fd, buf);
 
-  if (open_state.fd < 0)
-    return real__fxstat64 (ver, fd, buf);
+  vfile_stat64 (vfile, buf);
+  return 0;
+}
 
-  if (open_state.fd != fd)
-    {
-#ifdef TDPKG_INFO
-      fprintf (stderr, "tdpkg: nested __fxstat64(%d) detected, no wrapping\n", fd);
-#endif
-      return real__fxstat64 (ver, fd, buf);
-    }
+int
+fstat (int fd, struct stat* buf)
+{
+  struct VirtualFile* vfile = vfile_lookup (fd);
+  if (!vfile)
+    return realfstat (fd, buf);
 
-  buf->st_size = open_state.len;
-  buf->st_mode = S_IFREG;
+  vfile_stat (vfile, buf);
+  return 0;
+}
+
+int
+fstat64 (int fd, struct stat64* buf)
+{
+  struct VirtualFile* vfile = vfile_lookup (fd);
+  if (!vfile)
+    return realfstat64 (fd, buf);
+
+  vfile_stat64 (vfile, buf);
+  return 0;
+}
+
+int
+fstatat (int dirfd, const char *path, struct stat* buf, int flags)
+{
+  struct VirtualFile* vfile = vfile_lookup_at (dirfd, path, flags);
+  if (!vfile)
+    return realfstatat (dirfd, path, buf, flags);
+
+  vfile_stat (vfile, buf);
+  return 0;
+}
+
+int
+fstatat64 (int dirfd, const char *path, struct stat64* buf, int flags)
+{
+  struct VirtualFile* vfile = vfile_lookup_at (dirfd, path, flags);
+  if (!vfile)
+    return realfstatat64 (dirfd, path, buf, flags);
+
+  vfile_stat64 (vfile, buf);
+  return 0;
+}
+
+#ifdef STATX_TYPE
+int
+statx (int dirfd, const char *path, int flags, unsigned int mask, struct statx* buf)
+{
+  struct VirtualFile* vfile = vfile_lookup_at (dirfd, path, flags);
+  if (!vfile)
+    return realstatx (dirfd, path, flags, mask, buf);
+
+  memset (buf, '\0', sizeof (struct statx));
+  buf->stx_mask = STATX_TYPE | STATX_MODE | STATX_SIZE;
+  buf->stx_mode = S_IFREG;
+  buf->stx_size = vfile->len;
   return 0;
 }
+#endif
 
 ssize_t
 read (int fildes, void *buf, size_t nbyte)
 {
-  if (!cache_initialized)
+  struct VirtualFile* vfile = vfile_lookup (fildes);
+  if (!vfile)
     return realread (fildes, buf, nbyte);
 
-  if (open_state.fd < 0)
-    return realread (fildes, buf, nbyte);
+  ssize_t nowread = vfile_pread (vfile, buf, nbyte, vfile->offset);
+  if (nowread > 0)
+    vfile->offset += nowread;
+  return nowread;
+}
 
-  if (open_state.fd != fildes)
-    {
-#ifdef TDPKG_INFO
-      fprintf (stderr, "tdpkg: nested read(%d) detected, no wrapping\n", fildes);
-#endif
-      return realread (fildes, buf, nbyte);
-    }
+ssize_t
+__read_chk (int fildes, void *buf, size_t nbyte, size_t buflen)
+{
+  if (nbyte > buflen)
+    __chk_fail ();
+  return read (fildes, buf, nbyte);
+}
 
-  if (open_state.read > open_state.len)
-    {
-#ifdef TDPKG_INFO
-      fprintf (stderr, "tdpkg: useless read(%d) detected, returning 0\n", open_state.fd);
-#endif
-      return 0;
-    }
+ssize_t
+pread (int fildes, void *buf, size_t nbyte, off_t offset)
+{
+  struct VirtualFile* vfile = vfile_lookup (fildes);
+  if (!vfile)
+    return realpread (fildes, buf, nbyte, offset);
 
-  size_t nowread = (open_state.len-open_state.read) > nbyte ? nbyte : (open_state.len-open_state.read);
-  memcpy (buf, open_state.contents+open_state.read, nowread);
-  open_state.read += nowread;
-  return nowread;
+  return vfile_pread (vfile, buf, nbyte, offset);
+}
+
+ssize_t
+pread64 (int fildes, void *buf, size_t nbyte, off64_t offset)
+{
+  struct VirtualFile* vfile = vfile_lookup (fildes);
+  if (!vfile)
+    return realpread64 (fildes, buf, nbyte, offset);
+
+  return vfile_pread (vfile, buf, nbyte, offset);
+}
+
+ssize_t
+__pread_chk (int fildes, void *buf, size_t nbyte, off_t offset, size_t buflen)
+{
+  if (nbyte > buflen)
+    __chk_fail ();
+  return pread (fildes, buf, nbyte, offset);
+}
+
+ssize_t
+__pread64_chk (int fildes, void *buf, size_t nbyte, off64_t offset, size_t buflen)
+{
+  if (nbyte > buflen)
+    __chk_fail ();
+  return pread64 (fildes, buf, nbyte, offset);
+}
+
+off_t
+lseek (int fildes, off_t offset, int whence)
+{
+  struct VirtualFile* vfile = vfile_lookup (fildes);
+  if (!vfile)
+    return reallseek (fildes, offset, whence);
+
+  return vfile_seek (vfile, offset, whence);
+}
+
+off64_t
+lseek64 (int fildes, off64_t offset, int whence)
+{
+  struct VirtualFile* vfile = vfile_lookup (fildes);
+  if (!vfile)
+    return reallseek64 (fildes, offset, whence);
+
+  return vfile_seek (vfile, offset, whence);
 }
 
 int
-close (int fd)
+dup (int fildes)
 {
-  if (!cache_initialized)
-    return realclose (fd);
+  int fd = vfile_claim (realdup (fildes));
+  struct VirtualFile* vfile = vfile_lookup (fildes);
+  if (fd >= 0 && vfile)
+    {
+      vfile->refs++;
+      vfile_set (fd, vfile);
+    }
+  return fd;
+}
 
-  if (open_state.fd < 0)
-    return realclose (fd);
+static int
+_tdpkg_dup3 (int fildes, int fildes2, int flags)
+{
+  int fd;
+  if (flags < 0)
+    fd = realdup2 (fildes, fildes2);
+  else
+    fd = realdup3 (fildes, fildes2, flags);
+  if (fd < 0 || fildes == fildes2)
+    return fd;
 
-  if (open_state.fd != fd)
+  vfile_claim (fd);
+  struct VirtualFile* vfile = vfile_lookup (fildes);
+  if (vfile)
     {
-#ifdef TDPKG_INFO
-      fprintf (stderr, "tdpkg: close() on unknown fd %d, no wrapping\n", fd);
-#endif
-      return realclose (fd);
+      vfile->refs++;
+      vfile_set (fd, vfile);
     }
+  return fd;
+}
 
-  open_state.fd = -1;
-  if (open_state.contents)
-    free (open_state.contents);
-  open_state.contents = NULL;
-  open_state.len = 0;
-  open_state.read = 0;
-  return 0;
+int
+dup2 (int fildes, int fildes2)
+{
+  return _tdpkg_dup3 (fildes, fildes2, -1);
+}
+
+int
+dup3 (int fildes, int fildes2, int flags)
+{
+  return _tdpkg_dup3 (fildes, fildes2, flags);
+}
+
+int
+close (int fd)
+{
+  if (vfile_lookup (fd))
+    TDPKG_PROBE1 (close, fd);
+  vfile_forget (fd);
+  return realclose (fd);
 }
@@ -0,0 +1,259 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Checks and rebuilds the cache for every process preloading libtdpkg.so,
+   see server.h. The info directory is watched, so that the cache is
+   rebuilt soon after it changes rather than by the next dpkg. Runs in the
+   foreground until SIGTERM or SIGINT. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "cache.h"
+#include "backend.h"
+#include "server.h"
+#include "util.h"
+
+/* the info directory is checked once it's been left alone this long */
+#define QUIET_MS 1000
+/* how often a running rebuild is polled for */
+#define REAP_MS 100
+
+static volatile sig_atomic_t quit = 0;
+static int listen_fd = -1;
+static pid_t rebuilding = 0;
+/* the last check holds until the info directory or the admin one, where
+   the cache is replaced, change or a rebuild ends */
+static int checked = 0;
+static int check_result = 0;
+static int check_fd = -1;
+
+static void
+_tdpkgd_quit (int sig)
+{
+  quit = 1;
+}
+
+static long long
+_tdpkgd_now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* the cache is rebuilt in a child so that clients are answered
+   meanwhile, they read list files from disk until it's done */
+static void
+_tdpkgd_rebuild (void)
+{
+  if (rebuilding)
+    return;
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      fprintf (stderr, "tdpkgd: can't fork: %s\n", strerror (errno));
+      return;
+    }
+  if (!pid)
+    {
+      close (listen_fd);
+      int result = tdpkg_cache_rebuild ();
+      fflush (stdout);
+      _exit (result ? 1 : 0);
+    }
+  rebuilding = pid;
+}
+
+static void
+_tdpkgd_reap (void)
+{
+  int status;
+  if (rebuilding && waitpid (rebuilding, &status, WNOHANG) == rebuilding)
+    {
+      if (!WIFEXITED (status) || WEXITSTATUS (status))
+        fprintf (stderr, "tdpkgd: cache rebuild failed\n");
+      rebuilding = 0;
+      checked = 0;
+    }
+}
+
+/* returns 0 if the cache is in sync, *fd is then a descriptor of it */
+static int
+_tdpkgd_check (int* fd)
+{
+  *fd = -1;
+  if (rebuilding)
+    return 1;
+  if (!checked)
+    {
+      if (check_fd >= 0)
+        close (check_fd);
+      check_result = tdpkg_cache_check (&check_fd);
+      checked = 1;
+      if (check_result)
+        {
+          if (check_fd >= 0)
+            close (check_fd);
+          check_fd = -1;
+          _tdpkgd_rebuild ();
+        }
+    }
+  if (!check_result && check_fd >= 0)
+    *fd = fcntl (check_fd, F_DUPFD_CLOEXEC, 0);
+  return check_result;
+}
+
+/* returns 1 if the info directory itself changed */
+static int
+_tdpkgd_read_events (int notify_fd, int info_wd)
+{
+  char events[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  int info_changed = 0;
+  ssize_t len;
+  while ((len = read (notify_fd, events, sizeof (events))) > 0)
+    {
+      char* p;
+      for (p = events; p < events + len; p += sizeof (struct inotify_event) + ((struct inotify_event*) p)->len)
+        if (((struct inotify_event*) p)->wd == info_wd)
+          info_changed = 1;
+    }
+  checked = 0;
+  return info_changed;
+}
+
+static void
+_tdpkgd_serve (void)
+{
+  int client = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (client < 0)
+    return;
+
+  int fd = -1;
+  int state = TDPKG_SERVED_OTHER;
+  if (!tdpkg_server_receive (client, tdpkg_backend_name ()))
+    state = _tdpkgd_check (&fd) ? TDPKG_SERVED_STALE : TDPKG_SERVED_FRESH;
+  tdpkg_server_reply (client, state, fd);
+  if (fd >= 0)
+    close (fd);
+  close (client);
+}
+
+int
+main (int argc, char** argv)
+{
+  if (argc > 1)
+    {
+      fprintf (stderr, "usage: tdpkgd\n");
+      return 2;
+    }
+
+  /* this process is the one being asked */
+  setenv ("TDPKG_SERVER", "0", 1);
+  if (tdpkg_cache_initialize ())
+    {
+      fprintf (stderr, "tdpkgd: cache initialization failed\n");
+      return 1;
+    }
+
+  int notify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  int info_wd = notify_fd < 0 ? -1 : inotify_add_watch (notify_fd, tdpkg_info_dir (),
+                                                        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                                                        | IN_CLOSE_WRITE | IN_ATTRIB);
+  if (info_wd < 0)
+    {
+      fprintf (stderr, "tdpkgd: can't watch %s: %s\n", tdpkg_info_dir (), strerror (errno));
+      return 1;
+    }
+  /* caches renamed into place and tdpkg.dirty */
+  if (inotify_add_watch (notify_fd, tdpkg_admin_dir (), IN_CREATE | IN_DELETE | IN_MOVED_TO) < 0)
+    {
+      fprintf (stderr, "tdpkgd: can't watch %s: %s\n", tdpkg_admin_dir (), strerror (errno));
+      return 1;
+    }
+
+  listen_fd = tdpkg_server_listen ();
+  if (listen_fd < 0)
+    return 1;
+
+  struct sigaction action;
+  memset (&action, '\0', sizeof (action));
+  action.sa_handler = _tdpkgd_quit;
+  sigaction (SIGTERM, &action, NULL);
+  sigaction (SIGINT, &action, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  int fd;
+  if (!_tdpkgd_check (&fd) && fd >= 0)
+    close (fd);
+
+  int changed = 0;
+  long long last_change = 0;
+  while (!quit)
+    {
+      struct pollfd fds[2] = { { listen_fd, POLLIN, 0 }, { notify_fd, POLLIN, 0 } };
+      int timeout = -1;
+      if (rebuilding)
+        timeout = REAP_MS;
+      else if (changed)
+        timeout = QUIET_MS;
+      if (poll (fds, 2, timeout) < 0 && errno != EINTR)
+        {
+          fprintf (stderr, "tdpkgd: poll failed: %s\n", strerror (errno));
+          break;
+        }
+      _tdpkgd_reap ();
+
+      if ((fds[1].revents & POLLIN) && _tdpkgd_read_events (notify_fd, info_wd))
+        {
+          changed = 1;
+          last_change = _tdpkgd_now_ms ();
+        }
+      /* changes done while rebuilding are caught by the next check */
+      if (changed && !rebuilding && _tdpkgd_now_ms () - last_change >= QUIET_MS)
+        {
+          changed = 0;
+          if (!_tdpkgd_check (&fd) && fd >= 0)
+            close (fd);
+        }
+      if (fds[0].revents & POLLIN)
+        _tdpkgd_serve ();
+    }
+
+  char* socket_file = tdpkg_admin_path (SERVER_SOCKET_NAME);
+  unlink (socket_file);
+  free (socket_file);
+  if (rebuilding)
+    waitpid (rebuilding, NULL, 0);
+  if (check_fd >= 0)
+    close (check_fd);
+  tdpkg_cache_finalize ();
+  return 0;
+}
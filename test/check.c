@@ -0,0 +1,131 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "check.h"
+#include "cache.h"
+#include "util.h"
+
+char*
+check_admindir (const char* backend)
+{
+  char* admindir = strdup ("/tmp/tdpkg-check.XXXXXX");
+  if (!mkdtemp (admindir))
+    CHECK_FAIL ("can't create %s", admindir);
+  char* info = malloc (strlen (admindir) + 6);
+  sprintf (info, "%s/info", admindir);
+  if (mkdir (info, 0755))
+    CHECK_FAIL ("can't create %s", info);
+  free (info);
+
+  setenv ("DPKG_ADMINDIR", admindir, 1);
+  setenv ("TDPKG_BACKEND", backend, 1);
+  /* a tdpkgd running for the system must not be asked */
+  setenv ("TDPKG_SERVER", "0", 1);
+  return admindir;
+}
+
+char*
+check_info_path (const char* name)
+{
+  char* path = tdpkg_admin_path ("info");
+  path = realloc (path, strlen (path) + strlen (name) + 2);
+  strcat (path, "/");
+  strcat (path, name);
+  return path;
+}
+
+static FILE*
+_check_create (const char* name)
+{
+  char* path = check_info_path (name);
+  FILE* file = fopen (path, "w");
+  if (!file)
+    CHECK_FAIL ("can't write %s", path);
+  free (path);
+  return file;
+}
+
+void
+check_write_file (const char* name, const char* contents)
+{
+  FILE* file = _check_create (name);
+  fputs (contents, file);
+  fclose (file);
+}
+
+void
+check_write_list (const char* name, const char* prefix, int n)
+{
+  FILE* file = _check_create (name);
+  fprintf (file, "/opt\n/opt/%s\n", prefix);
+  int i;
+  for (i=0; i < n; i++)
+    fprintf (file, "/opt/%s/file%d\n", prefix, i);
+  fclose (file);
+}
+
+int
+check_cached (const char* name, int may_miss)
+{
+  char* path = check_info_path (name);
+
+  struct stat stat_buf;
+  char* expected = tdpkg_read_file (path, &stat_buf, 0);
+  size_t len;
+  int compressed;
+  const char* contents = tdpkg_cache_borrow_filename (path, &len, &compressed);
+  int result = -1;
+  if (!expected)
+    fprintf (stderr, "%s: can't be read\n", name);
+  else if (!contents && may_miss)
+    result = 0;
+  else if (!contents)
+    fprintf (stderr, "%s: not served from the cache\n", name);
+  else if (compressed || len != stat_buf.st_size || memcmp (contents, expected, len))
+    fprintf (stderr, "%s: served contents differ from the file\n", name);
+  else
+    result = 0;
+
+  if (contents)
+    tdpkg_cache_release_filename (contents);
+  free (expected);
+  free (path);
+  return result;
+}
+
+static int
+_check_remove (const char* path, const struct stat* buf, int flag, struct FTW* ftw)
+{
+  return remove (path);
+}
+
+void
+check_remove_admindir (char* admindir)
+{
+  nftw (admindir, _check_remove, 16, FTW_DEPTH | FTW_PHYS);
+  free (admindir);
+}
@@ -0,0 +1,41 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHECK_H
+#define CHECK_H
+
+/* Helpers of the programs run by `make check', each on an admin directory
+   of its own so that the system one is never touched. */
+
+#define CHECK_FAIL(...) do { fprintf (stderr, __VA_ARGS__); fputc ('\n', stderr); exit (1); } while (0)
+
+/* creates the admin directory with an empty info directory and points
+   DPKG_ADMINDIR at it, backend is the one to test */
+char* check_admindir (const char* backend);
+/* info/name, newly allocated */
+char* check_info_path (const char* name);
+void check_write_file (const char* name, const char* contents);
+/* writes info/name, listing n files under /opt/prefix */
+void check_write_list (const char* name, const char* prefix, int n);
+/* returns 0 if info/name is served from the cache as it is on disk, or
+   isn't served at all when may_miss is set */
+int check_cached (const char* name, int may_miss);
+void check_remove_admindir (char* admindir);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Interned paths: list files expand back to what they were, and a reader
+   decodes paths another process interned after it loaded them. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "check.h"
+#include "cache.h"
+
+static const char* const lists[] = { "a.list", "big.list", "relative.list", "slash.list",
+                                     "unterminated.list", "empty.list" };
+
+int
+main (int argc, char** argv)
+{
+  const char* backend = argc > 1 ? argv[1] : "packed";
+  char* admindir = check_admindir (backend);
+  setenv ("TDPKG_COMPRESS", "paths", 1);
+
+  check_write_list ("a.list", "a", 100);
+  /* more nodes than a chunk holds */
+  check_write_list ("big.list", "big", 10000);
+  /* stored verbatim */
+  check_write_file ("relative.list", "/opt\nopt/a\n");
+  check_write_file ("slash.list", "/opt/\n");
+  check_write_file ("unterminated.list", "/opt/a");
+  check_write_file ("empty.list", "");
+  if (tdpkg_cache_initialize () || tdpkg_cache_rebuild ())
+    CHECK_FAIL ("can't build the cache");
+  tdpkg_cache_finalize ();
+
+  int result = 0;
+  size_t i;
+  if (tdpkg_cache_initialize ())
+    CHECK_FAIL ("can't open the cache");
+  for (i=0; i < sizeof (lists) / sizeof (lists[0]); i++)
+    result |= check_cached (lists[i], 0);
+
+  int go[2];
+  if (pipe (go))
+    CHECK_FAIL ("can't create a pipe");
+  pid_t pid = fork ();
+  if (!pid)
+    {
+      /* interns new paths once the reader has loaded the others */
+      char c;
+      close (go[1]);
+      if (read (go[0], &c, 1) != 1 || tdpkg_cache_initialize ())
+        _exit (1);
+      check_write_list ("new.list", "new", 100);
+      char* path = check_info_path ("new.list");
+      int failed = tdpkg_cache_write_filename (path);
+      free (path);
+      tdpkg_cache_finalize ();
+      _exit (failed ? 1 : 0);
+    }
+  close (go[0]);
+
+  int status;
+  if (write (go[1], "", 1) != 1 || waitpid (pid, &status, 0) != pid || status)
+    CHECK_FAIL ("the writer failed");
+  /* only sqlite readers see what has been committed since they opened
+     the cache, the others keep the cache they opened and miss */
+  result |= check_cached ("new.list", strcmp (backend, "sqlite") != 0);
+  tdpkg_cache_finalize ();
+
+  if (tdpkg_cache_initialize ())
+    CHECK_FAIL ("can't open the cache");
+  result |= check_cached ("new.list", 0) | check_cached ("a.list", 0);
+  tdpkg_cache_finalize ();
+
+  check_remove_admindir (admindir);
+  return result ? 1 : 0;
+}
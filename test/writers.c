@@ -0,0 +1,88 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Two writers one after the other, the first having read the cache before
+   the second committed: the batch of the first must start from what the
+   second committed, interned paths included. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "check.h"
+#include "cache.h"
+#include "util.h"
+
+static void
+_writers_write (const char* name, const char* prefix)
+{
+  check_write_list (name, prefix, 100);
+  char* path = check_info_path (name);
+  if (tdpkg_cache_write_filename (path))
+    CHECK_FAIL ("can't write %s through the cache", name);
+  free (path);
+}
+
+int
+main (int argc, char** argv)
+{
+  char* admindir = check_admindir (argc > 1 ? argv[1] : "packed");
+  setenv ("TDPKG_COMPRESS", "paths", 1);
+
+  check_write_list ("a.list", "a", 100);
+  if (tdpkg_cache_initialize () || tdpkg_cache_rebuild ())
+    CHECK_FAIL ("can't build the cache");
+  tdpkg_cache_finalize ();
+
+  int go[2];
+  if (pipe (go))
+    CHECK_FAIL ("can't create a pipe");
+  pid_t pid = fork ();
+  if (!pid)
+    {
+      /* the second writer, once the first has read the cache */
+      char c;
+      close (go[1]);
+      if (read (go[0], &c, 1) != 1 || tdpkg_cache_initialize ())
+        _exit (1);
+      _writers_write ("newb.list", "BBB");
+      tdpkg_cache_finalize ();
+      _exit (0);
+    }
+  close (go[0]);
+
+  if (tdpkg_cache_initialize () || check_cached ("a.list", 0))
+    CHECK_FAIL ("a.list is not cached");
+  int status;
+  if (write (go[1], "", 1) != 1 || waitpid (pid, &status, 0) != pid || status)
+    CHECK_FAIL ("the second writer failed");
+  _writers_write ("newa.list", "AAA");
+  tdpkg_cache_finalize ();
+
+  if (tdpkg_cache_initialize ())
+    CHECK_FAIL ("can't open the cache");
+  int result = check_cached ("a.list", 0) | check_cached ("newa.list", 0) | check_cached ("newb.list", 0);
+  tdpkg_cache_finalize ();
+
+  check_remove_admindir (admindir);
+  return result ? 1 : 0;
+}
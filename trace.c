@@ -0,0 +1,147 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define TRACE_EVENTS 65536
+#define TRACE_ARG_SIZE 48
+
+struct TraceEvent
+{
+  const char* name;
+  uint64_t start;
+  uint64_t duration;
+  char arg[TRACE_ARG_SIZE];
+};
+
+int tdpkg_trace_enabled = 0;
+
+static struct TraceEvent* events = NULL;
+/* events added so far, the ring holds the last TRACE_EVENTS */
+static uint64_t n_events = 0;
+
+static uint64_t
+_trace_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+tdpkg_trace_initialize (void)
+{
+  const char* prefix = getenv ("TDPKG_TRACE");
+  if (!prefix || !*prefix)
+    return;
+  events = malloc (TRACE_EVENTS * sizeof (struct TraceEvent));
+  tdpkg_trace_enabled = events != NULL;
+}
+
+uint64_t
+tdpkg_trace_start (void)
+{
+  return tdpkg_trace_enabled ? _trace_now () : 0;
+}
+
+void
+tdpkg_trace_stop (const char* name, const char* arg, uint64_t start)
+{
+  if (!start || !tdpkg_trace_enabled)
+    return;
+
+  struct TraceEvent* event = &events[n_events++ % TRACE_EVENTS];
+  event->name = name;
+  event->start = start;
+  event->duration = _trace_now () - start;
+  event->arg[0] = '\0';
+  if (arg)
+    {
+      size_t len = strlen (arg);
+      if (len >= TRACE_ARG_SIZE)
+        arg += len - (TRACE_ARG_SIZE-1);
+      strcpy (event->arg, arg);
+    }
+}
+
+static void
+_trace_write_string (FILE* file, const char* str)
+{
+  fputc ('"', file);
+  for (; *str; str++)
+    {
+      if (*str == '"' || *str == '\\')
+        fprintf (file, "\\%c", *str);
+      else if ((unsigned char)*str < 0x20)
+        fprintf (file, "\\u%04x", *str);
+      else
+        fputc (*str, file);
+    }
+  fputc ('"', file);
+}
+
+void
+tdpkg_trace_write (void)
+{
+  if (!tdpkg_trace_enabled)
+    return;
+
+  char filename[4096];
+  snprintf (filename, sizeof (filename), "%s.%d.json", getenv ("TDPKG_TRACE"), (int) getpid ());
+  FILE* file = fopen (filename, "w");
+  if (!file)
+    {
+      fprintf (stderr, "tdpkg: can't write trace to %s: %s\n", filename, strerror (errno));
+      return;
+    }
+
+  int pid = getpid ();
+  int tid = syscall (SYS_gettid);
+  fprintf (file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  uint64_t first = n_events > TRACE_EVENTS ? n_events - TRACE_EVENTS : 0;
+  uint64_t i;
+  for (i=first; i < n_events; i++)
+    {
+      struct TraceEvent* event = &events[i % TRACE_EVENTS];
+      fprintf (file, "%s{\"name\":\"%s\",\"cat\":\"tdpkg\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+               i > first ? ",\n" : "", event->name, pid, tid, event->start / 1000.0, event->duration / 1000.0);
+      if (event->arg[0])
+        {
+          fprintf (file, ",\"args\":{\"arg\":");
+          _trace_write_string (file, event->arg);
+          fputc ('}', file);
+        }
+      fputc ('}', file);
+    }
+  fprintf (file, "\n]}\n");
+  if (fclose (file))
+    fprintf (stderr, "tdpkg: can't write trace to %s: %s\n", filename, strerror (errno));
+
+  free (events);
+  events = NULL;
+  tdpkg_trace_enabled = 0;
+}
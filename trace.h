@@ -0,0 +1,60 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Static probes for perf, bpftrace and systemtap, built in when
+   sys/sdt.h is available. They cost a nop until attached:
+     open_entry (path), open_return (path, fd), read (nbyte, offset),
+     close (fd), rename (old, new), unlink (path),
+     init_entry, init_return (result), freshness (trusted),
+     rebuild_entry, rebuild_return (result) */
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#define TDPKG_HAVE_SDT
+#endif
+#endif
+
+#ifdef TDPKG_HAVE_SDT
+#include <sys/sdt.h>
+#define TDPKG_PROBE(name) DTRACE_PROBE (tdpkg, name)
+#define TDPKG_PROBE1(name, a) DTRACE_PROBE1 (tdpkg, name, a)
+#define TDPKG_PROBE2(name, a, b) DTRACE_PROBE2 (tdpkg, name, a, b)
+#else
+#define TDPKG_PROBE(name) do { } while (0)
+#define TDPKG_PROBE1(name, a) do { } while (0)
+#define TDPKG_PROBE2(name, a, b) do { } while (0)
+#endif
+
+/* With TDPKG_TRACE=prefix the last spans of this process are kept in a
+   ring buffer and written as a Chrome trace to prefix.<pid>.json when it
+   exits. Only the thread that called into tdpkg adds spans. */
+extern int tdpkg_trace_enabled;
+
+void tdpkg_trace_initialize (void);
+/* returns 0 when tracing is disabled */
+uint64_t tdpkg_trace_start (void);
+/* arg may be NULL, only its end is kept when it's long */
+void tdpkg_trace_stop (const char* name, const char* arg, uint64_t start);
+void tdpkg_trace_write (void);
+
+#endif
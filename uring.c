@@ -0,0 +1,224 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#ifdef __NR_io_uring_setup
+
+/* rings can be set up since 5.1 but statx, openat and close only came
+   with 5.6, along with the probe itself */
+static int
+_ring_supports (TdpkgRing* ring, const unsigned char* opcodes, int n_opcodes)
+{
+#ifdef IO_URING_OP_SUPPORTED
+  struct io_uring_probe* probe = calloc (1, sizeof (struct io_uring_probe)
+                                         + 256 * sizeof (struct io_uring_probe_op));
+  int result = !syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256);
+  int i;
+  for (i=0; result && i < n_opcodes; i++)
+    result = opcodes[i] <= probe->last_op && probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED;
+  free (probe);
+  return result;
+#else
+  return 0;
+#endif
+}
+
+int
+tdpkg_ring_init (TdpkgRing* ring, unsigned entries, const unsigned char* opcodes, int n_opcodes)
+{
+  struct io_uring_params params;
+  memset (ring, '\0', sizeof (TdpkgRing));
+  memset (&params, '\0', sizeof (params));
+
+  ring->fd = syscall (__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+    return -1;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP && ring->cq_ring_size > ring->sq_ring_size)
+    ring->sq_ring_size = ring->cq_ring_size;
+
+  ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    {
+      close (ring->fd);
+      return -1;
+    }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+        {
+          munmap (ring->sq_ring, ring->sq_ring_size);
+          close (ring->fd);
+          return -1;
+        }
+    }
+
+  ring->sq_entries = params.sq_entries;
+  ring->sqes = mmap (NULL, params.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    {
+      if (ring->cq_ring != ring->sq_ring)
+        munmap (ring->cq_ring, ring->cq_ring_size);
+      munmap (ring->sq_ring, ring->sq_ring_size);
+      close (ring->fd);
+      return -1;
+    }
+
+  char* sq = ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  char* cq = ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  if (!_ring_supports (ring, opcodes, n_opcodes))
+    {
+      tdpkg_ring_free (ring);
+      return -1;
+    }
+  return 0;
+}
+
+void
+tdpkg_ring_free (TdpkgRing* ring)
+{
+  munmap (ring->sqes, ring->sq_entries * sizeof (struct io_uring_sqe));
+  if (ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  munmap (ring->sq_ring, ring->sq_ring_size);
+  close (ring->fd);
+}
+
+struct io_uring_sqe*
+tdpkg_ring_get_sqe (TdpkgRing* ring)
+{
+  unsigned head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->to_submit;
+  if (tail - head >= ring->sq_entries)
+    return NULL;
+
+  unsigned index = tail & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  ring->to_submit++;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset (sqe, '\0', sizeof (struct io_uring_sqe));
+  return sqe;
+}
+
+/* handles up to n completions already posted */
+static unsigned
+_ring_reap (TdpkgRing* ring, unsigned n, TdpkgRingFunc func, void* data)
+{
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+  unsigned n_reaped = 0;
+  for (; head != tail && n_reaped < n; head++, n_reaped++)
+    {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      func (cqe->user_data, cqe->res, data);
+    }
+  __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+  return n_reaped;
+}
+
+int
+tdpkg_ring_wait (TdpkgRing* ring, unsigned n, TdpkgRingFunc func, void* data)
+{
+  /* publish the queued requests to the kernel */
+  __atomic_store_n (ring->sq_tail, *ring->sq_tail + ring->to_submit, __ATOMIC_RELEASE);
+  unsigned to_submit = ring->to_submit;
+  ring->to_submit = 0;
+
+  while (n > 0)
+    {
+      int res = syscall (__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          /* the completion queue is full, reap it before submitting more */
+          if (errno != EAGAIN && errno != EBUSY)
+            return -1;
+          res = 0;
+        }
+      to_submit -= res;
+
+      n -= _ring_reap (ring, n, func, data);
+    }
+  return 0;
+}
+
+void
+tdpkg_ring_reap (TdpkgRing* ring, TdpkgRingFunc func, void* data)
+{
+  _ring_reap (ring, ring->sq_entries * 2, func, data);
+}
+
+#else
+
+int
+tdpkg_ring_init (TdpkgRing* ring, unsigned entries, const unsigned char* opcodes, int n_opcodes)
+{
+  return -1;
+}
+
+void
+tdpkg_ring_free (TdpkgRing* ring)
+{
+}
+
+struct io_uring_sqe*
+tdpkg_ring_get_sqe (TdpkgRing* ring)
+{
+  return NULL;
+}
+
+int
+tdpkg_ring_wait (TdpkgRing* ring, unsigned n, TdpkgRingFunc func, void* data)
+{
+  return -1;
+}
+
+void
+tdpkg_ring_reap (TdpkgRing* ring, TdpkgRingFunc func, void* data)
+{
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+    Copyright © 2010 Luca Bruno
+
+    This file is part of tdpkg.
+
+    tdpkg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    tdpkg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with tdpkg.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/* A minimal io_uring driven by raw system calls, the loader uses it to
+   batch the system calls needed to read list files. */
+
+typedef struct
+{
+  int fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned sq_entries;
+  unsigned to_submit;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+} TdpkgRing;
+
+/* called for each completion with the user_data of its request and the
+   result of the system call, a negated errno on failure */
+typedef void (*TdpkgRingFunc) (unsigned long long user_data, int res, void* data);
+
+/* returns -1 if io_uring is not available or lacks one of the n_opcodes
+   opcodes */
+int tdpkg_ring_init (TdpkgRing* ring, unsigned entries, const unsigned char* opcodes, int n_opcodes);
+void tdpkg_ring_free (TdpkgRing* ring);
+/* returns a cleared request, or NULL when the submission queue is full */
+struct io_uring_sqe* tdpkg_ring_get_sqe (TdpkgRing* ring);
+/* submits the queued requests and waits for n completions */
+int tdpkg_ring_wait (TdpkgRing* ring, unsigned n, TdpkgRingFunc func, void* data);
+/* handles the completions already posted without waiting, i.e. after
+   tdpkg_ring_wait failed */
+void tdpkg_ring_reap (TdpkgRing* ring, TdpkgRingFunc func, void* data);
+
+#endif
@@ -18,18 +18,238 @@
 */
 
 #define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <sys/stat.h>
 
+#include "util.h"
+
+/* lines of CONFIG_FILE are "name = value", '#' starts a comment */
+int
+tdpkg_config (const char* name, char* value, size_t size)
+{
+  FILE* file = fopen (CONFIG_FILE, "r");
+  if (!file)
+    return -1;
+
+  int found = 0;
+  char line[4096];
+  while (!found && fgets (line, sizeof (line), file))
+    {
+      char* key = line;
+      while (isspace ((unsigned char)*key))
+        key++;
+      size_t key_len = strcspn (key, "= \t\n#");
+      if (key_len != strlen (name) || strncmp (key, name, key_len))
+        continue;
+      char* start = key + key_len + strspn (key + key_len, " \t");
+      if (*start++ != '=')
+        continue;
+      start += strspn (start, " \t");
+      size_t len = strcspn (start, " \t\n#");
+      if (len >= size)
+        continue;
+      memcpy (value, start, len);
+      value[len] = '\0';
+      found = 1;
+    }
+  fclose (file);
+  return found ? 0 : -1;
+}
+
+const char*
+tdpkg_admin_dir (void)
+{
+  static char* admin_dir = NULL;
+  if (admin_dir)
+    return admin_dir;
+
+  char configured[4096];
+  const char* dir = getenv ("DPKG_ADMINDIR");
+  if ((!dir || !*dir) && !tdpkg_config ("admindir", configured, sizeof (configured)))
+    dir = configured;
+  if (!dir || !*dir)
+    dir = ADMIN_DIR;
+  admin_dir = strdup (dir);
+  /* so that paths built by dpkg from the same directory match */
+  size_t len = strlen (admin_dir);
+  while (len > 1 && admin_dir[len-1] == '/')
+    admin_dir[--len] = '\0';
+  return admin_dir;
+}
+
+const char*
+tdpkg_info_dir (void)
+{
+  static char* info_dir = NULL;
+  if (!info_dir)
+    info_dir = tdpkg_admin_path ("info");
+  return info_dir;
+}
+
+char*
+tdpkg_admin_path (const char* name)
+{
+  const char* dir = tdpkg_admin_dir ();
+  char* path = malloc (strlen (dir) + strlen (name) + 2);
+  sprintf (path, "%s/%s", dir, name);
+  return path;
+}
+
+const char* const*
+tdpkg_info_suffixes (void)
+{
+  static char** suffixes = NULL;
+  if (suffixes)
+    return (const char* const*)suffixes;
+
+  char configured[4096];
+  const char* files = getenv ("TDPKG_FILES");
+  if ((!files || !*files) && !tdpkg_config ("files", configured, sizeof (configured)))
+    files = configured;
+  if (!files || !*files)
+    files = "list";
+
+  char* copy = strdup (files);
+  int n_suffixes = 0;
+  suffixes = malloc ((strlen (copy)/2 + 2) * sizeof (char*));
+  char* save;
+  char* suffix;
+  for (suffix = strtok_r (copy, ",", &save); suffix; suffix = strtok_r (NULL, ",", &save))
+    {
+      if (*suffix == '.')
+        suffix++;
+      if (*suffix)
+        suffixes[n_suffixes++] = suffix;
+    }
+  if (!n_suffixes)
+    suffixes[n_suffixes++] = "list";
+  suffixes[n_suffixes] = NULL;
+  return (const char* const*)suffixes;
+}
+
+/* with_new also matches the names dpkg writes before renaming them */
+static int
+_util_is_cached_name (const char* path, int with_new)
+{
+  const char* dot = strrchr (path, '.');
+  if (!dot || strchr (dot, '/'))
+    return 0;
+
+  const char* const* suffixes = tdpkg_info_suffixes ();
+  int i;
+  for (i=0; suffixes[i]; i++)
+    {
+      size_t len = strlen (suffixes[i]);
+      if (!strncmp (dot+1, suffixes[i], len)
+          && (!dot[len+1] || (with_new && !strcmp (dot+len+1, "-new"))))
+        return 1;
+    }
+  return 0;
+}
+
+static int
+_util_is_cached_file (const char* path, int with_new)
+{
+  const char* info_dir = tdpkg_info_dir ();
+  size_t len = strlen (info_dir);
+  const char* found = strstr (path, info_dir);
+  return found && found[len] == '/' && _util_is_cached_name (found+len, with_new);
+}
+
+int
+tdpkg_is_cached_name (const char* path)
+{
+  return _util_is_cached_name (path, 0);
+}
+
+int
+tdpkg_is_cached_file (const char* path)
+{
+  return _util_is_cached_file (path, 0);
+}
+
+int
+tdpkg_is_cached_new_file (const char* path)
+{
+  return _util_is_cached_file (path, 1);
+}
+
 int
 tdpkg_stat (const char* filename, struct stat* buf)
 {
 #ifndef __USE_FILE_OFFSET64
   struct stat64 buf64;
-  int result = __xstat64 (_STAT_VER, filename, &buf64);
+  int result = stat64 (filename, &buf64);
+  buf->st_dev = buf64.st_dev;
+  buf->st_ino = buf64.st_ino;
+  buf->st_mode = buf64.st_mode;
   buf->st_size = buf64.st_size;
-  buf->st_mtime = buf64.st_mtime;
+  buf->st_mtim = buf64.st_mtim;
   return result;
 #else
-  return __xstat (_STAT_VER, filename, &buf));
+  return stat (filename, buf);
 #endif
 }
+
+/* returns the contents of filename stored at offset of a newly
+   allocated buffer, buf is filled with the stat of the file */
+char*
+tdpkg_read_file (const char* filename, struct stat* buf, size_t offset)
+{
+  /* we don't use fstat because it's been wrapped */
+  if (tdpkg_stat (filename, buf))
+    {
+      fprintf (stderr, "tdpkg: can't stat %s: %s\n", filename, strerror (errno));
+      return NULL;
+    }
+
+  char* contents = tdpkg_read_file_stat (filename, buf, offset);
+  if (!contents && errno == ESTALE)
+    fprintf (stderr, "tdpkg: can't read full file %s of size %zu\n", filename, (size_t) buf->st_size);
+  return contents;
+}
+
+/* like tdpkg_read_file with buf being the stat of filename already taken,
+   fails with ESTALE if the size of filename changed since */
+char*
+tdpkg_read_file_stat (const char* filename, const struct stat* buf, size_t offset)
+{
+  size_t size = buf->st_size;
+  FILE* file = fopen (filename, "r");
+  if (!file)
+    {
+      fprintf (stderr, "tdpkg: can't open %s: %s\n", filename, strerror (errno));
+      return NULL;
+    }
+
+  char* contents = malloc (offset+size+1);
+  if (fread (contents+offset, sizeof (char), size, file) < size || getc (file) != EOF)
+    {
+      free (contents);
+      fclose (file);
+      errno = ESTALE;
+      return NULL;
+    }
+  fclose (file);
+  contents[offset+size] = '\0';
+
+  return contents;
+}
+
+/* FNV-1a, used by the hash tables of the cache */
+uint32_t
+tdpkg_hash (const char* key, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i=0; i < len; i++)
+    {
+      hash ^= (unsigned char)key[i];
+      hash *= 16777619u;
+    }
+  return hash;
+}
@@ -20,6 +20,37 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define ADMIN_DIR "/var/lib/dpkg"
+#define CONFIG_FILE "/etc/tdpkg.conf"
+
+/* looks name up in CONFIG_FILE, returns 0 if found */
+int tdpkg_config (const char* name, char* value, size_t size);
+/* DPKG_ADMINDIR like dpkg itself, admindir in CONFIG_FILE or ADMIN_DIR */
+const char* tdpkg_admin_dir (void);
+/* the info directory in the admin directory, holding the list files */
+const char* tdpkg_info_dir (void);
+/* returns name in the admin directory, newly allocated */
+char* tdpkg_admin_path (const char* name);
+/* the suffixes of the files of the info directory being cached, from
+   TDPKG_FILES or files in CONFIG_FILE, comma separated, only "list" by
+   default. The array ends with NULL */
+const char* const* tdpkg_info_suffixes (void);
+/* returns 1 if the last component of path ends with '.' and one of the
+   suffixes */
+int tdpkg_is_cached_name (const char* path);
+/* like is_cached_name, path being in the info directory */
+int tdpkg_is_cached_file (const char* path);
+/* like is_cached_file, or with one of the suffixes followed by "-new" like
+   dpkg writes them before renaming them in place */
+int tdpkg_is_cached_new_file (const char* path);
+
 int tdpkg_stat (const char* filename, struct stat* buf);
+char* tdpkg_read_file (const char* filename, struct stat* buf, size_t offset);
+char* tdpkg_read_file_stat (const char* filename, const struct stat* buf, size_t offset);
+uint32_t tdpkg_hash (const char* key, size_t len);
 
 #endif